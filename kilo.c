@@ -5,23 +5,51 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_CHUNK_SIZE 4096
+#define KILO_HASH_BASE 1099511628211ULL
+#define KILO_OUTQ_LIMIT 4096
+#define KILO_MAX_GROUPS 10
+#define KILO_PARALLEL_MIN (1 << 20)
+#define KILO_MAX_THREADS 64
+#define KILO_SPECULATE_ROWS 4096
+#define KILO_BRACKET_BLOCK 32
+#define KILO_MIN_WORD 2
+#define KILO_MAX_WORD 64
+#define KILO_MAX_COMPLETIONS 8
+#define KILO_DIFF_MAX_EDITS 1000
+#define KILO_GUTTER_WIDTH 2
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -35,7 +63,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  SHIFT_TAB
 };
 
 enum editorHighlight {
@@ -52,8 +81,30 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_QUOTE (1<<2)
+#define CC_SCS_START (1<<3)
+#define CC_MCS_START (1<<4)
+#define CC_MCE_START (1<<5)
+#define CC_KEYWORD_START (1<<6)
+
 /*** data ***/
 
+struct editorKeyword {
+  char *word;
+  int len;
+  int type;
+};
+
+struct editorLexer {
+  unsigned char charClass[256];
+  int scsLen, mcsLen, mceLen;
+  struct editorKeyword *keywordTable;
+  unsigned int keywordMask;
+  int maxKeywordLen;
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -61,8 +112,27 @@ struct editorSyntax {
   char *singleLineCommentStart;
   char *multiLineCommentStart, *multiLineCommentEnd;
   int flags;
+  char *stringQuotes;
+  char *separators;
+  struct editorLexer *lexer;
+};
+
+struct editorLexState {
+  int inComment;
+  int inString;
+  int prevSeparator;
+  int prevNumber;
 };
 
+typedef struct editorChunk {
+  int cx;
+  int renderAt;
+  int renderX;
+  int highlightAt;
+  struct editorLexState highlightState;
+  uint64_t hash, power;
+} editorChunk;
+
 typedef struct editorRow {
   int idx;
   int size;
@@ -71,8 +141,47 @@ typedef struct editorRow {
   char *render;
   unsigned char *highlight;
   int highlightOpenComment;
+  int isAscii;
+  int sharedRender;
+  editorChunk *chunks;
+  int numChunks;
+  int *brackets;
+  int numBrackets;
+  int bracketsDirty;
+  uint64_t hash;
 } editorRow;
 
+struct editorBracketSpan {
+  int sum;
+  int minPrefix;
+  int maxSuffix;
+};
+
+/* A treap node holding a block of consecutive rows. Nodes are ordered
+ * by position: 'size' counts the rows in the subtree, 'block' sums the
+ * node's own rows and 'span' the whole subtree. */
+struct editorBracketNode {
+  int left, right;
+  unsigned int priority;
+  int rows, size;
+  int dirty, blockDirty;
+  struct editorBracketSpan block[3];
+  struct editorBracketSpan span[3];
+};
+
+struct editorFold {
+  int start;
+  int end;
+};
+
+struct editorWordNode {
+  int child;
+  int next;
+  int count;
+  int best;
+  unsigned char c;
+};
+
 struct editorConfig {
   int cursorX, cursorY;
   int renderX;
@@ -86,6 +195,43 @@ struct editorConfig {
   time_t statusMsgTime;
   struct editorSyntax *syntax;
   struct termios orig_termios;
+  int inPrompt;
+  int watchFd, watchWd, watchDirWd;
+  off_t fileSize;
+  ino_t fileIno;
+  struct timespec fileMtime;
+  int fileEndsWithNewline;
+  int follow;
+  uint64_t *shadow;
+  int shadowValid;
+  int shadowRowOffset, shadowColOffset;
+  int outFd;
+  char *outBuf;
+  int outLen, outSent;
+  int refreshPending;
+  int resizePipe[2];
+  int selectActive, selectAnchor;
+  char **clipboard;
+  int *clipboardLens;
+  int clipboardRows;
+  struct editorBracketNode *bracketNodes;
+  int numBracketNodes, bracketNodesCap;
+  int bracketFree, bracketRoot;
+  int bracketTreeValid;
+  struct editorWordNode *words;
+  int numWords, wordsCap;
+  char *completions[KILO_MAX_COMPLETIONS];
+  int numCompletions, completionIndex, completionPrefixLen;
+  uint64_t *savedHashes;
+  int numSavedRows;
+  unsigned char *diffMarks;
+  int diffEdits;
+  int diffFrom, diffTo;
+  int diffMarkFrom, diffMarkTo, diffMarksCap;
+  int gutterWidth;
+  struct editorFold *folds;
+  int numFolds, foldsCap;
+  int *foldHidden;
 };
 
 struct editorConfig E;
@@ -107,21 +253,72 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    "\"'", NULL, NULL
   },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+struct editorSyntax *loadedSyntax = NULL;
+int numLoadedSyntax = 0;
+
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorUpdateSyntax(editorRow *row);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorReadPrompt(char *prompt, void (*callback)(char *, int),
+                       int allowEmpty);
+void editorHandleFileEvents();
+void editorWatchFile();
+uint64_t editorHashBytes(const char *s, int len);
+void editorMarkBrackets(editorRow *row);
+void editorBracketInsertRows(int at, int count);
+void editorBracketDelRows(int at, int count);
+void editorShiftFolds(int at, int delta);
+void editorDiffTouch(int from, int to);
+void editorClearDiff();
 
 /*** terminal ***/
 
+void editorFlushOutput() {
+  while (E.outSent < E.outLen) {
+    ssize_t n = write(E.outFd, &E.outBuf[E.outSent], E.outLen - E.outSent);
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EINTR) E.outSent = E.outLen;
+      break;
+    }
+    E.outSent += n;
+  }
+  if (E.outSent == E.outLen) E.outLen = E.outSent = 0;
+}
+
+void editorDrainOutput() {
+  while (E.outSent < E.outLen) {
+    struct pollfd pfd = { E.outFd, POLLOUT, 0 };
+    poll(&pfd, 1, 100);
+    editorFlushOutput();
+  }
+}
+
+int editorOutputBusy() {
+  if (E.outSent < E.outLen) return 1;
+
+  int queued;
+  return ioctl(E.outFd, TIOCOUTQ, &queued) == 0 && queued > KILO_OUTQ_LIMIT;
+}
+
+void editorQueueOutput(const char *s, int len) {
+  E.outBuf = realloc(E.outBuf, E.outLen + len);
+  memcpy(&E.outBuf[E.outLen], s, len);
+  E.outLen += len;
+  editorFlushOutput();
+}
+
 void die(const char *s) {
+  editorDrainOutput();
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
 
@@ -149,11 +346,74 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
+void editorHandleSigWinch(int sig) {
+  (void) sig;
+  int savedErrno = errno;
+  write(E.resizePipe[1], "", 1);
+  errno = savedErrno;
+}
+
+void editorWatchResize() {
+  if (pipe(E.resizePipe) == -1) die("pipe");
+  for (int j = 0; j < 2; j++) {
+    fcntl(E.resizePipe[j], F_SETFL, O_NONBLOCK);
+    fcntl(E.resizePipe[j], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigWinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+int editorHandleResize() {
+  char buf[64];
+  while (read(E.resizePipe[0], buf, sizeof(buf)) > 0)
+    ;
+
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 ||
+      ws.ws_row < 3)
+    return 0;
+  if (ws.ws_row - 2 == E.screenRows && ws.ws_col == E.screenCols) return 0;
+
+  E.screenRows = ws.ws_row - 2;
+  E.screenCols = ws.ws_col;
+  free(E.shadow);
+  E.shadow = calloc(E.screenRows + 2, sizeof(uint64_t));
+  E.shadowValid = 0;
+  E.refreshPending = 1;
+  return 1;
+}
+
+int editorWaitInput() {
+  struct pollfd fds[4] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { E.inPrompt ? -1 : E.watchFd, POLLIN, 0 },
+    { E.outFd, (E.outSent < E.outLen) ? POLLOUT : 0, 0 },
+    { E.resizePipe[0], POLLIN, 0 }
+  };
+  if (poll(fds, 4, E.refreshPending ? 10 : 100) == -1) return 0;
+
+  int resized = 0;
+  if (fds[3].revents & POLLIN) resized = editorHandleResize();
+  if (fds[2].revents & POLLOUT) editorFlushOutput();
+  if (fds[1].revents & POLLIN) editorHandleFileEvents();
+  if (E.refreshPending && !resized && !editorOutputBusy()) editorRefreshScreen();
+  return fds[0].revents != 0;
+}
+
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+  while (1) {
+    if (!editorWaitInput()) continue;
+    nread = read(STDIN_FILENO, &c, 1);
+    if (nread == 1) break;
     if (nread == -1 && errno != EAGAIN) die("read");
+  }
 
   if (c == '\x1b') {
     char seq[3];
@@ -177,6 +437,7 @@ int editorReadKey() {
     }
       } else {
         switch (seq[1]) {
+          case 'Z': return SHIFT_TAB;
           case 'A': return ARROW_UP;
           case 'B': return ARROW_DOWN;
           case 'C': return ARROW_RIGHT;
@@ -194,7 +455,7 @@ int editorReadKey() {
 
     return '\x1b';
   } else
-    return c;
+    return (unsigned char) c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -229,89 +490,289 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** unicode ***/
+
+struct widthRange {
+  int first, last;
+};
+
+const struct widthRange zeroWidthTable[] = {
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+  { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+  { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+  { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0900, 0x0902 },
+  { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+  { 0x094d, 0x094d }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a },
+  { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+  { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x2064 },
+  { 0x20d0, 0x20ff }, { 0x302a, 0x302d }, { 0x3099, 0x309a },
+  { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff },
+  { 0xe0100, 0xe01ef }
+};
+
+const struct widthRange wideTable[] = {
+  { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+  { 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 },
+  { 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+  { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+  { 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea },
+  { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa },
+  { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+  { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+  { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+  { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c },
+  { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+  { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff },
+  { 0xa000, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 },
+  { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+  { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+  { 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 },
+  { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+  { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f }, { 0x1f680, 0x1f6ff },
+  { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff },
+  { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+};
+
+#define WIDTH_TABLE_ENTRIES(t) ((int) (sizeof(t) / sizeof(t[0])))
+
+int widthTableContains(const struct widthRange *table, int entries, int cp) {
+  if (cp < table[0].first || cp > table[entries - 1].last) return 0;
+
+  int low = 0, high = entries - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (cp > table[mid].last) low = mid + 1;
+    else if (cp < table[mid].first) high = mid - 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int utf8CharWidth(int cp) {
+  if (cp < 0x300) return 1;
+  if (widthTableContains(zeroWidthTable, WIDTH_TABLE_ENTRIES(zeroWidthTable), cp))
+    return 0;
+  if (widthTableContains(wideTable, WIDTH_TABLE_ENTRIES(wideTable), cp))
+    return 2;
+  return 1;
+}
+
+int utf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *) s;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+
+  int seqLen, min;
+  if ((u[0] & 0xe0) == 0xc0) seqLen = 2, *cp = u[0] & 0x1f, min = 0x80;
+  else if ((u[0] & 0xf0) == 0xe0) seqLen = 3, *cp = u[0] & 0x0f, min = 0x800;
+  else if ((u[0] & 0xf8) == 0xf0) seqLen = 4, *cp = u[0] & 0x07, min = 0x10000;
+  else {
+    *cp = -1;
+    return 1;
+  }
+
+  if (seqLen > len) {
+    *cp = -1;
+    return 1;
+  }
+  for (int j = 1; j < seqLen; j++) {
+    if ((u[j] & 0xc0) != 0x80) {
+      *cp = -1;
+      return 1;
+    }
+    *cp = (*cp << 6) | (u[j] & 0x3f);
+  }
+  if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff)) {
+    *cp = -1;
+    return 1;
+  }
+  return seqLen;
+}
+
+int utf8ScanAscii(const char *s, int len, int *tabs) {
+  int high = 0;
+  int j = 0;
+  *tabs = 0;
+
+#ifdef __SSE2__
+  __m128i tab = _mm_set1_epi8('\t');
+  for (; j + 16 <= len; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &s[j]);
+    high |= _mm_movemask_epi8(v);
+    *tabs += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+  }
+#endif
+
+  for (; j < len; j++) {
+    high |= (unsigned char) s[j] & 0x80;
+    if (s[j] == '\t') (*tabs)++;
+  }
+  return high == 0;
+}
+
 /*** syntax highlighting ***/
 
-int isSeparator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+unsigned int editorHashKeyword(const char *s, int len) {
+  unsigned int hash = 2166136261u;
+  for (int j = 0; j < len; j++) {
+    hash ^= (unsigned char) s[j];
+    hash *= 16777619u;
+  }
+  return hash;
 }
 
-void editorUpdateSyntax(editorRow *row) {
-  row->highlight = realloc(row->highlight, row->renderSize);
-  memset(row->highlight, HL_NORMAL, row->renderSize);
+void editorCompileSyntax(struct editorSyntax *syntax) {
+  struct editorLexer *lexer = malloc(sizeof(struct editorLexer));
+  syntax->lexer = lexer;
+
+  char *separators = syntax->separators ? syntax->separators :
+                                          ",.()+-/*=~%<>[];";
+  memset(lexer->charClass, 0, sizeof(lexer->charClass));
+  lexer->charClass[0] = CC_SEPARATOR;
+  for (int c = 1; c < 256; c++) {
+    if (isspace(c) || strchr(separators, c)) lexer->charClass[c] |= CC_SEPARATOR;
+    if (isdigit(c)) lexer->charClass[c] |= CC_DIGIT;
+  }
 
-  if (E.syntax == NULL) return;
+  if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    char *quotes = syntax->stringQuotes ? syntax->stringQuotes : "\"'";
+    for (int j = 0; quotes[j]; j++)
+      lexer->charClass[(unsigned char) quotes[j]] |= CC_QUOTE;
+  }
 
-  char **keywords = E.syntax->keywords;
+  char *scs = syntax->singleLineCommentStart;
+  char *mcs = syntax->multiLineCommentStart;
+  char *mce = syntax->multiLineCommentEnd;
+  lexer->scsLen = (scs && *scs) ? strlen(scs) : 0;
+  lexer->mcsLen = (mcs && *mcs && mce && *mce) ? strlen(mcs) : 0;
+  lexer->mceLen = lexer->mcsLen ? strlen(mce) : 0;
+  if (lexer->scsLen)
+    lexer->charClass[(unsigned char) scs[0]] |= CC_SCS_START;
+  if (lexer->mcsLen) {
+    lexer->charClass[(unsigned char) mcs[0]] |= CC_MCS_START;
+    lexer->charClass[(unsigned char) mce[0]] |= CC_MCE_START;
+  }
+
+  int numKeywords = 0;
+  while (syntax->keywords[numKeywords]) numKeywords++;
+  unsigned int size = 16;
+  while (size < (unsigned int) numKeywords * 2) size *= 2;
+  lexer->keywordTable = calloc(size, sizeof(struct editorKeyword));
+  lexer->keywordMask = size - 1;
+  lexer->maxKeywordLen = 0;
+
+  for (int j = 0; j < numKeywords; j++) {
+    char *word = syntax->keywords[j];
+    int len = strlen(word);
+    int type = HL_KEYWORD1;
+    if (len > 0 && word[len - 1] == '|') {
+      type = HL_KEYWORD2;
+      len--;
+    }
+    if (len == 0) continue;
+
+    unsigned int slot = editorHashKeyword(word, len) & lexer->keywordMask;
+    while (lexer->keywordTable[slot].word &&
+           (lexer->keywordTable[slot].len != len ||
+            strncmp(lexer->keywordTable[slot].word, word, len)))
+      slot = (slot + 1) & lexer->keywordMask;
+
+    lexer->keywordTable[slot].word = word;
+    lexer->keywordTable[slot].len = len;
+    lexer->keywordTable[slot].type = type;
+    lexer->charClass[(unsigned char) word[0]] |= CC_KEYWORD_START;
+    if (len > lexer->maxKeywordLen) lexer->maxKeywordLen = len;
+  }
+}
 
-  char *scs = E.syntax->singleLineCommentStart;
-  char *mcs = E.syntax->multiLineCommentStart;
-  char *mce = E.syntax->multiLineCommentEnd;
+int editorMatchKeyword(struct editorLexer *lexer, const char *s, int *len) {
+  int tokenLen = 0;
+  while (tokenLen <= lexer->maxKeywordLen &&
+         !(lexer->charClass[(unsigned char) s[tokenLen]] & CC_SEPARATOR))
+    tokenLen++;
+  if (tokenLen > lexer->maxKeywordLen) return 0;
+
+  unsigned int slot = editorHashKeyword(s, tokenLen) & lexer->keywordMask;
+  while (lexer->keywordTable[slot].word) {
+    struct editorKeyword *keyword = &lexer->keywordTable[slot];
+    if (keyword->len == tokenLen && !strncmp(keyword->word, s, tokenLen)) {
+      *len = tokenLen;
+      return keyword->type;
+    }
+    slot = (slot + 1) & lexer->keywordMask;
+  }
+  return 0;
+}
 
-  int scsLen = scs ? strlen(scs) : 0;
-  int mcsLen = mcs ? strlen(mcs) : 0;
-  int mceLen = mce ? strlen(mce) : 0;
+int editorHighlightRange(editorRow *row, int i, int end,
+                         struct editorLexState *state) {
+  struct editorSyntax *syntax = E.syntax;
+  struct editorLexer *lexer = syntax->lexer;
 
-  int prevSeparator = 1;
-  int inString = 0;
-  int inComment = (row->idx > 0 && E.row[row->idx - 1].highlightOpenComment);
+  int prevSeparator = state->prevSeparator;
+  int inString = state->inString;
+  int inComment = state->inComment;
 
-  int i = 0;
-  while (i < row->renderSize) {
-    char c = row->render[i];
+  while (i < end && i < row->renderSize) {
+    unsigned char c = row->render[i];
+    int charClass = lexer->charClass[c];
     unsigned char prevHighlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
 
-    if (scsLen && !inString && !inComment) {
-      if (!strncmp(&row->render[i], scs, scsLen)) {
-        memset(&row->highlight[i], HL_COMMENT, row->renderSize - i);
-        break;
-      }
+    if (inComment) {
+      row->highlight[i] = HL_COMMENT;
+      if ((charClass & CC_MCE_START) &&
+          !strncmp(&row->render[i], syntax->multiLineCommentEnd, lexer->mceLen)) {
+        memset(&row->highlight[i], HL_MLCOMMENT, lexer->mceLen);
+        i += lexer->mceLen;
+        inComment = 0;
+        prevSeparator = 1;
+      } else
+        i++;
+      continue;
     }
 
-    if (mcsLen && mceLen && !inString) {
-      if (inComment) {
-        row->highlight[i] = HL_COMMENT;
-        if (!strncmp(&row->render[i], mce, mceLen)) {
-          memset(&row->highlight[i], HL_MLCOMMENT, mceLen);
-          i += mceLen;
-          inComment = 0;
-          prevSeparator = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcsLen)) {
-        memset(&row->highlight[i], HL_MLCOMMENT, mcsLen);
-        i += mcsLen;
-        inComment = 1;
+    if (inString) {
+      row->highlight[i] = HL_STRING;
+      if (c == '\\' && i + 1 < row->renderSize) {
+        row->highlight[i + 1] = HL_STRING;
+        i += 2;
         continue;
       }
+      if (c == inString) inString = 0;
+      i++;
+      prevSeparator = 1;
+      continue;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (inString) {
-        row->highlight[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->renderSize) {
-          row->highlight[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == inString) inString = 0;
-        i++;
-        prevSeparator = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          inString = c;
-          row->highlight[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
+    if ((charClass & CC_SCS_START) &&
+        !strncmp(&row->render[i], syntax->singleLineCommentStart, lexer->scsLen)) {
+      memset(&row->highlight[i], HL_COMMENT, row->renderSize - i);
+      i = row->renderSize;
+      break;
+    }
+
+    if ((charClass & CC_MCS_START) &&
+        !strncmp(&row->render[i], syntax->multiLineCommentStart, lexer->mcsLen)) {
+      memset(&row->highlight[i], HL_MLCOMMENT, lexer->mcsLen);
+      i += lexer->mcsLen;
+      inComment = 1;
+      continue;
+    }
+
+    if (charClass & CC_QUOTE) {
+      inString = c;
+      row->highlight[i] = HL_STRING;
+      i++;
+      continue;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prevSeparator || prevHighlight == HL_NUMBER)) ||
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (((charClass & CC_DIGIT) && (prevSeparator || prevHighlight == HL_NUMBER)) ||
           (c == '.' && prevHighlight == HL_NUMBER)) {
         row->highlight[i] = HL_NUMBER;
         i++;
@@ -320,34 +781,136 @@ void editorUpdateSyntax(editorRow *row) {
       }
     }
 
-    if (prevSeparator) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int keywordLen = strlen(keywords[j]);
-        int keyword2 = keywords[j][keywordLen - 1] == '|';
-        if (keyword2) keywordLen--;
-
-        if (!strncmp(&row->render[i], keywords[j], keywordLen) &&
-            isSeparator(row->render[i + keywordLen])) {
-          memset(&row->highlight[i], keyword2 ? HL_KEYWORD2 : HL_KEYWORD1, keywordLen);
-          i += keywordLen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+    if (prevSeparator && (charClass & CC_KEYWORD_START)) {
+      int keywordLen;
+      int type = editorMatchKeyword(lexer, &row->render[i], &keywordLen);
+      if (type) {
+        memset(&row->highlight[i], type, keywordLen);
+        i += keywordLen;
         prevSeparator = 0;
         continue;
       }
     }
 
-    prevSeparator = isSeparator(c);
+    prevSeparator = (charClass & CC_SEPARATOR) != 0;
     i++;
   }
 
-  int changed = (row->highlightOpenComment != inComment);
-  row->highlightOpenComment = inComment;
-  if (changed && row->idx + 1 < E.numRows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  state->prevSeparator = prevSeparator;
+  state->inString = inString;
+  state->inComment = inComment;
+  state->prevNumber = (i > 0 && row->highlight[i - 1] == HL_NUMBER);
+  return i;
+}
+
+void editorHighlightEntryState(editorRow *row, struct editorLexState *state) {
+  state->inComment = (row->idx > 0 && E.row[row->idx - 1].highlightOpenComment);
+  state->inString = 0;
+  state->prevSeparator = 1;
+  state->prevNumber = 0;
+}
+
+int editorHighlightDone(editorRow *row, struct editorLexState *state) {
+  int changed = (row->highlightOpenComment != state->inComment);
+  row->highlightOpenComment = state->inComment;
+  return changed;
+}
+
+/* Highlights a row from the given entry state, leaving the exit state in
+ * 'state'. Unlike editorHighlightRow it never looks at neighbouring rows,
+ * so it can run on rows that are not part of E.row yet. */
+void editorHighlightRowFrom(editorRow *row, struct editorLexState *state) {
+  row->highlight = realloc(row->highlight, row->renderSize);
+  memset(row->highlight, HL_NORMAL, row->renderSize);
+
+  if (E.syntax == NULL) return;
+
+  int i = 0;
+  for (int j = 0; j < row->numChunks; j++) {
+    i = editorHighlightRange(row, i, row->chunks[j].renderAt, state);
+    row->chunks[j].highlightAt = i;
+    row->chunks[j].highlightState = *state;
+  }
+  editorHighlightRange(row, i, row->renderSize, state);
+}
+
+int editorHighlightRow(editorRow *row) {
+  editorMarkBrackets(row);
+  struct editorLexState state;
+  editorHighlightEntryState(row, &state);
+  editorHighlightRowFrom(row, &state);
+  return editorHighlightDone(row, &state);
+}
+
+/* Highlights rows [from, to) and keeps going past 'to' for as long as
+ * a row's open comment state changes, so a batch of edited rows costs a
+ * single pass. */
+void editorUpdateSyntaxRows(int from, int to) {
+  for (int i = from; i < E.numRows; i++)
+    if (!editorHighlightRow(&E.row[i]) && i + 1 >= to) break;
+}
+
+void editorUpdateSyntax(editorRow *row) {
+  editorUpdateSyntaxRows(row->idx, row->idx + 1);
+}
+
+/* Re-highlights a chunked row from chunk 'from' onwards after an edit.
+ * oldIdx maps each chunk to its pre-edit index (or -1 when it is new);
+ * once a checkpoint past the edit is reached in the same lexer state as
+ * before, the rest of the old highlight (already shifted by 'shift')
+ * is reused as is. */
+void editorUpdateSyntaxFrom(editorRow *row, int from, editorChunk *old,
+                            int *oldIdx, int shift) {
+  editorMarkBrackets(row);
+  if (E.syntax == NULL) {
+    memset(&row->highlight[row->chunks[from].renderAt], HL_NORMAL,
+           row->renderSize - row->chunks[from].renderAt);
+    return;
+  }
+
+  int start = from - 1;
+  while (start > 0 &&
+         row->chunks[start].highlightAt > row->chunks[start + 1].renderAt)
+    start--;
+
+  struct editorLexState state;
+  int i;
+  if (start < 0) {
+    editorHighlightEntryState(row, &state);
+    i = 0;
+    start = 0;
+  } else {
+    state = row->chunks[start].highlightState;
+    i = row->chunks[start].highlightAt;
+    start++;
+  }
+
+  for (int j = start; j < row->numChunks; j++) {
+    editorChunk *chunk = &row->chunks[j];
+    if (chunk->renderAt > i) memset(&row->highlight[i], HL_NORMAL, chunk->renderAt - i);
+    i = editorHighlightRange(row, i, chunk->renderAt, &state);
+    chunk->highlightAt = i;
+    chunk->highlightState = state;
+
+    if (j > from && oldIdx[j] != -1) {
+      editorChunk *prev = &old[oldIdx[j]];
+      if (chunk->renderAt - prev->renderAt == shift &&
+          i - chunk->renderAt == prev->highlightAt - prev->renderAt &&
+          !memcmp(&state, &prev->highlightState, sizeof(state))) {
+        for (j++; j < row->numChunks; j++) {
+          row->chunks[j].highlightAt = old[oldIdx[j]].highlightAt + shift;
+          row->chunks[j].highlightState = old[oldIdx[j]].highlightState;
+        }
+        return;
+      }
+    }
+  }
+  if (row->renderSize > i)
+    memset(&row->highlight[i], HL_NORMAL, row->renderSize - i);
+  editorHighlightRange(row, i, row->renderSize, &state);
+
+  if (editorHighlightDone(row, &state))
+    editorUpdateSyntaxRows(row->idx + 1, row->idx + 2);
 }
 
 int editorSyntaxToColor(int highlight) {
@@ -363,142 +926,719 @@ int editorSyntaxToColor(int highlight) {
   }
 }
 
+char **editorAppendWords(char **list, char *words, char *suffix) {
+  int count = 0;
+  while (list[count]) count++;
+
+  char *word = strtok(words, " \t");
+  while (word) {
+    list = realloc(list, sizeof(char *) * (count + 2));
+    list[count] = malloc(strlen(word) + strlen(suffix) + 1);
+    strcpy(list[count], word);
+    strcat(list[count], suffix);
+    list[++count] = NULL;
+    word = strtok(NULL, " \t");
+  }
+  return list;
+}
+
+char *editorJoinWords(char *words) {
+  char *joined = malloc(strlen(words) + 1);
+  int len = 0;
+  for (char *p = words; *p; p++)
+    if (*p != ' ' && *p != '\t') joined[len++] = *p;
+  joined[len] = '\0';
+  return joined;
+}
+
+void editorLoadSyntaxFile(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return;
+
+  struct editorSyntax *syntax = NULL;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && isspace((unsigned char) line[linelen - 1]))
+      line[--linelen] = '\0';
+
+    char *directive = line;
+    while (isspace((unsigned char) *directive)) directive++;
+    if (*directive == '\0' || *directive == '#') continue;
+
+    char *args = directive;
+    while (*args && !isspace((unsigned char) *args)) args++;
+    if (*args) *args++ = '\0';
+    while (isspace((unsigned char) *args)) args++;
+
+    if (!strcmp(directive, "filetype")) {
+      loadedSyntax = realloc(loadedSyntax,
+          sizeof(struct editorSyntax) * (numLoadedSyntax + 1));
+      syntax = &loadedSyntax[numLoadedSyntax++];
+      memset(syntax, 0, sizeof(struct editorSyntax));
+      syntax->filetype = strdup(args);
+      syntax->filematch = calloc(1, sizeof(char *));
+      syntax->keywords = calloc(1, sizeof(char *));
+    } else if (syntax == NULL) {
+      continue;
+    } else if (!strcmp(directive, "filematch")) {
+      syntax->filematch = editorAppendWords(syntax->filematch, args, "");
+    } else if (!strcmp(directive, "keywords")) {
+      syntax->keywords = editorAppendWords(syntax->keywords, args, "");
+    } else if (!strcmp(directive, "types")) {
+      syntax->keywords = editorAppendWords(syntax->keywords, args, "|");
+    } else if (!strcmp(directive, "comment")) {
+      char *start = strtok(args, " \t");
+      if (start) syntax->singleLineCommentStart = strdup(start);
+    } else if (!strcmp(directive, "multiline")) {
+      char *start = strtok(args, " \t");
+      char *end = strtok(NULL, " \t");
+      if (start && end) {
+        syntax->multiLineCommentStart = strdup(start);
+        syntax->multiLineCommentEnd = strdup(end);
+      }
+    } else if (!strcmp(directive, "strings")) {
+      syntax->flags |= HL_HIGHLIGHT_STRINGS;
+      if (*args) syntax->stringQuotes = editorJoinWords(args);
+    } else if (!strcmp(directive, "numbers")) {
+      syntax->flags |= HL_HIGHLIGHT_NUMBERS;
+    } else if (!strcmp(directive, "separators")) {
+      syntax->separators = editorJoinWords(args);
+    }
+  }
+  free(line);
+  fclose(fp);
+}
+
+void editorLoadSyntaxDir(const char *dirname) {
+  DIR *dir = opendir(dirname);
+  if (!dir) return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char *ext = strrchr(entry->d_name, '.');
+    if (!ext || strcmp(ext, ".syntax")) continue;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+    editorLoadSyntaxFile(path);
+  }
+  closedir(dir);
+}
+
+void editorInitSyntax() {
+  char *dir = getenv("KILO_SYNTAX_DIR");
+  if (dir)
+    editorLoadSyntaxDir(dir);
+  else if (getenv("HOME")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.kilo/syntax", getenv("HOME"));
+    editorLoadSyntaxDir(path);
+  }
+
+  for (int i = 0; i < numLoadedSyntax; i++)
+    editorCompileSyntax(&loadedSyntax[i]);
+  for (unsigned int i = 0; i < HLDB_ENTRIES; i++)
+    editorCompileSyntax(&HLDB[i]);
+}
+
+int editorSyntaxMatches(struct editorSyntax *s) {
+  char *ext = strrchr(E.filename, '.');
+  for (unsigned int j = 0; s->filematch[j]; j++) {
+    int isExt = (s->filematch[j][0] == '.');
+    if ((isExt && ext && !strcmp(ext, s->filematch[j])) ||
+        (!isExt && strstr(E.filename, s->filematch[j])))
+      return 1;
+  }
+  return 0;
+}
+
 void editorSelectSyntaxHighlight() {
   E.syntax = NULL;
   if (E.filename == NULL) return;
 
-  char *ext = strrchr(E.filename, '.');
+  for (int i = 0; i < numLoadedSyntax && !E.syntax; i++)
+    if (editorSyntaxMatches(&loadedSyntax[i])) E.syntax = &loadedSyntax[i];
+  for (unsigned int i = 0; i < HLDB_ENTRIES && !E.syntax; i++)
+    if (editorSyntaxMatches(&HLDB[i])) E.syntax = &HLDB[i];
 
-  for (unsigned int i = 0; i < HLDB_ENTRIES; i++) {
-    struct editorSyntax *s = &HLDB[i];
-    unsigned int j = 0;
-    while (s->filematch[j]) {
-      int isExt = (s->filematch[j][0] == '.');
-      if ((isExt && ext && !strcmp(ext, s->filematch[j])) ||
-          (!isExt && strstr(E.filename, s->filematch[j]))) {
-        E.syntax = s;
+  if (E.syntax == NULL) return;
+  editorUpdateSyntaxRows(0, E.numRows);
+}
 
-        for (int fileRow = 0; fileRow < E.numRows; fileRow++)
-          editorUpdateSyntax(&E.row[fileRow]);
+/*** word index ***/
 
-        return;
-      }
-      j++;
+int editorIsWordChar(unsigned char c) {
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+int editorWordChild(int node, unsigned char c) {
+  int child = E.words[node].child;
+  while (child && E.words[child].c != c) child = E.words[child].next;
+  return child;
+}
+
+int editorWordNewChild(int node, unsigned char c) {
+  if (E.numWords == E.wordsCap) {
+    E.wordsCap *= 2;
+    E.words = realloc(E.words, sizeof(struct editorWordNode) * E.wordsCap);
+  }
+  int child = E.numWords++;
+  E.words[child].child = 0;
+  E.words[child].next = E.words[node].child;
+  E.words[child].count = 0;
+  E.words[child].best = 0;
+  E.words[child].c = c;
+  E.words[node].child = child;
+  return child;
+}
+
+/* Adds delta occurrences of a word to the trie. Every node keeps the
+ * highest count in its subtree, so that lookups can go straight to the
+ * most frequent words and skip branches whose words were all deleted. */
+void editorWordAdd(const char *word, int len, int delta) {
+  if (len < KILO_MIN_WORD || len > KILO_MAX_WORD) return;
+
+  int path[KILO_MAX_WORD + 1];
+  int node = 0;
+  path[0] = 0;
+  for (int j = 0; j < len; j++) {
+    int child = editorWordChild(node, word[j]);
+    if (!child) {
+      if (delta < 0) return;
+      child = editorWordNewChild(node, word[j]);
     }
+    node = path[j + 1] = child;
+  }
+  if (E.words[node].count + delta < 0) return;
+  E.words[node].count += delta;
+
+  for (int j = len; j >= 0; j--) {
+    struct editorWordNode *n = &E.words[path[j]];
+    int best = n->count;
+    for (int child = n->child; child; child = E.words[child].next)
+      if (E.words[child].best > best) best = E.words[child].best;
+    if (best == n->best) break;
+    n->best = best;
+  }
+}
+
+/* Adds or removes the words overlapping [from, to), widened to whole
+ * words, so that an edit only has to touch the words around it. */
+void editorIndexWords(editorRow *row, int from, int to, int delta) {
+  if (to > row->size) to = row->size;
+  if (from > to) from = to;
+  while (from > 0 && editorIsWordChar(row->chars[from - 1])) from--;
+  while (to < row->size && editorIsWordChar(row->chars[to])) to++;
+
+  int i = from;
+  while (i < to) {
+    while (i < to && !editorIsWordChar(row->chars[i])) i++;
+    int start = i;
+    while (i < to && editorIsWordChar(row->chars[i])) i++;
+    if (i > start) editorWordAdd(&row->chars[start], i - start, delta);
+  }
+}
+
+void editorResetWords() {
+  if (E.words == NULL) {
+    E.wordsCap = 1024;
+    E.words = malloc(sizeof(struct editorWordNode) * E.wordsCap);
   }
+  memset(&E.words[0], 0, sizeof(struct editorWordNode));
+  E.numWords = 1;
 }
 
 /*** row operations ***/
 
+int editorCharWidth(const char *s, int len, int renderX, int *width) {
+  if (*s == '\t') {
+    *width = KILO_TAB_STOP - (renderX % KILO_TAB_STOP);
+    return 1;
+  }
+
+  int cp;
+  int seqLen = utf8Decode(s, len, &cp);
+  *width = utf8CharWidth(cp);
+  return seqLen;
+}
+
+int editorRowFindChunk(editorRow *row, size_t field, int value) {
+  int low = 0, high = row->numChunks - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (*(int *) ((char *) &row->chunks[mid] + field) <= value) low = mid;
+    else high = mid - 1;
+  }
+  return low;
+}
+
 int editorRowCxToRx(editorRow *row, int cursorX) {
   int renderX = 0;
-  for (int j = 0; j < cursorX; j++) {
-    if (row->chars[j] == '\t')
-      renderX += (KILO_TAB_STOP - 1) - (renderX % KILO_TAB_STOP);
-    renderX++;
+  int j = 0;
+  if (row->numChunks) {
+    editorChunk *chunk = &row->chunks[editorRowFindChunk(row,
+        offsetof(editorChunk, cx), cursorX)];
+    j = chunk->cx;
+    renderX = chunk->renderX;
+  }
+
+  if (row->isAscii) {
+    for (; j < cursorX; j++) {
+      if (row->chars[j] == '\t')
+        renderX += (KILO_TAB_STOP - 1) - (renderX % KILO_TAB_STOP);
+      renderX++;
+    }
+    return renderX;
+  }
+
+  while (j < cursorX && j < row->size) {
+    int width;
+    j += editorCharWidth(&row->chars[j], row->size - j, renderX, &width);
+    renderX += width;
   }
   return renderX;
 }
 
 int editorRowRxToCx(editorRow *row, int renderX) {
   int currentRenderX = 0;
-  int cursorX;
-  for (cursorX = 0; cursorX < row->size; cursorX++) {
-    if (row->chars[cursorX] == '\t')
-      currentRenderX += (KILO_TAB_STOP - 1) - (currentRenderX % KILO_TAB_STOP);
-    currentRenderX++;
+  int cursorX = 0;
+  if (row->numChunks) {
+    editorChunk *chunk = &row->chunks[editorRowFindChunk(row,
+        offsetof(editorChunk, renderX), renderX)];
+    cursorX = chunk->cx;
+    currentRenderX = chunk->renderX;
+  }
+
+  if (row->isAscii) {
+    for (; cursorX < row->size; cursorX++) {
+      if (row->chars[cursorX] == '\t')
+        currentRenderX += (KILO_TAB_STOP - 1) - (currentRenderX % KILO_TAB_STOP);
+      currentRenderX++;
+
+      if (currentRenderX > renderX) return cursorX;
+    }
+    return cursorX;
+  }
+
+  while (cursorX < row->size) {
+    int width;
+    int len = editorCharWidth(&row->chars[cursorX], row->size - cursorX,
+                              currentRenderX, &width);
+    currentRenderX += width;
 
     if (currentRenderX > renderX) return cursorX;
+    cursorX += len;
   }
   return cursorX;
 }
 
-void editorUpdateRow(editorRow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+int editorRowRenderToRx(editorRow *row, int at) {
+  if (row->isAscii) return at;
 
-  free(row->render);
-  row->render = malloc(row->size + (tabs * (KILO_TAB_STOP - 1)) + 1);
+  int renderX = 0;
+  int j = 0;
+  if (row->numChunks) {
+    editorChunk *chunk = &row->chunks[editorRowFindChunk(row,
+        offsetof(editorChunk, renderAt), at)];
+    j = chunk->renderAt;
+    renderX = chunk->renderX;
+  }
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else
-      row->render[idx++] = row->chars[j];
+  while (j < at && j < row->renderSize) {
+    int cp;
+    j += utf8Decode(&row->render[j], row->renderSize - j, &cp);
+    renderX += utf8CharWidth(cp);
   }
+  return renderX;
+}
 
-  row->render[idx] = '\0';
-  row->renderSize = idx;
+int editorRowNextChar(editorRow *row, int at) {
+  if (at >= row->size) return row->size;
+  if (row->isAscii) return at + 1;
 
-  editorUpdateSyntax(row);
+  int cp;
+  at += utf8Decode(&row->chars[at], row->size - at, &cp);
+  while (at < row->size) {
+    int len = utf8Decode(&row->chars[at], row->size - at, &cp);
+    if (utf8CharWidth(cp) != 0) break;
+    at += len;
+  }
+  return at;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numRows) return;
+int editorRowPrevChar(editorRow *row, int at) {
+  if (at <= 0) return 0;
+  if (row->isAscii) return at - 1;
 
-  E.row = realloc(E.row, sizeof(editorRow) * (E.numRows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at));
-  for (int i = at + 1; i <= E.numRows; i++) E.row[i].idx++;
+  while (at > 0) {
+    int start = at - 1;
+    while (start > 0 && at - start < 4 &&
+           ((unsigned char) row->chars[start] & 0xc0) == 0x80)
+      start--;
 
-  E.row[at].idx = at;
+    int cp;
+    if (start + utf8Decode(&row->chars[start], row->size - start, &cp) != at) {
+      start = at - 1;
+      cp = -1;
+    }
+    at = start;
+    if (utf8CharWidth(cp) != 0) break;
+  }
+  return at;
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+int editorRowRender(editorRow *row, int from, int to, int idx, int *renderX) {
+  if (row->sharedRender) {
+    if (row->isAscii) *renderX = to;
+    else {
+      int width;
+      for (int j = from; j < to; *renderX += width)
+        j += editorCharWidth(&row->chars[j], to - j, *renderX, &width);
+    }
+    return to;
+  }
 
-  E.row[at].renderSize = 0;
-  E.row[at].render = NULL;
-  E.row[at].highlight = NULL;
-  E.row[at].highlightOpenComment = 0;
-  editorUpdateRow(&E.row[at]);
+  if (row->isAscii) {
+    int j = from;
+    while (j < to) {
+      char *tab = memchr(&row->chars[j], '\t', to - j);
+      int span = tab ? tab - &row->chars[j] : to - j;
+      memcpy(&row->render[idx], &row->chars[j], span);
+      idx += span;
+      j += span;
+      if (j < to) {
+        row->render[idx++] = ' ';
+        while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+        j++;
+      }
+    }
+    *renderX = idx;
+    return idx;
+  }
 
-  E.numRows++;
-  E.dirty++;
+  int j = from;
+  while (j < to) {
+    int width;
+    int len = editorCharWidth(&row->chars[j], to - j, *renderX, &width);
+    if (row->chars[j] == '\t') {
+      memset(&row->render[idx], ' ', width);
+      idx += width;
+    } else {
+      memcpy(&row->render[idx], &row->chars[j], len);
+      idx += len;
+    }
+    *renderX += width;
+    j += len;
+  }
+  return idx;
 }
 
-void editorFreeRow(editorRow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->highlight);
+void editorRowRenderFrom(editorRow *row, int from) {
+  int idx = 0, renderX = 0;
+  if (row->numChunks == 0)
+    idx = editorRowRender(row, 0, row->size, 0, &renderX);
+  else {
+    if (from > 0) {
+      idx = row->chunks[from].renderAt;
+      renderX = row->chunks[from].renderX;
+    }
+    for (int j = from; j < row->numChunks; j++) {
+      int end = (j + 1 < row->numChunks) ? row->chunks[j + 1].cx : row->size;
+      row->chunks[j].renderAt = idx;
+      row->chunks[j].renderX = renderX;
+      idx = editorRowRender(row, row->chunks[j].cx, end, idx, &renderX);
+    }
+  }
+
+  row->render[idx] = '\0';
+  row->renderSize = idx;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numRows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.numRows - at - 1));
-  for (int i = at; i < E.numRows - 1; i++) E.row[i].idx--;
-  E.numRows--;
-  E.dirty++;
+int editorRowChunkBoundary(editorRow *row, int cx) {
+  if (cx >= row->size) return row->size;
+  while (cx < row->size && ((unsigned char) row->chars[cx] & 0xc0) == 0x80)
+    cx++;
+  return cx;
+}
+
+/* Polynomial hash of a byte range. Unlike FNV it can be assembled from
+ * pieces: the hash of a followed by b is hash(a) * power(b) + hash(b),
+ * so long rows only rehash the chunks an edit touched. */
+uint64_t editorHashSpan(const char *s, int len, uint64_t *power) {
+  uint64_t hash = 0, p = 1;
+  for (int j = 0; j < len; j++) {
+    hash = hash * KILO_HASH_BASE + (unsigned char) s[j] + 1;
+    p *= KILO_HASH_BASE;
+  }
+  *power = p;
+  return hash;
+}
+
+void editorHashChunks(editorRow *row, int from, int to) {
+  for (int j = from; j < to; j++) {
+    int end = (j + 1 < row->numChunks) ? row->chunks[j + 1].cx : row->size;
+    row->chunks[j].hash = editorHashSpan(&row->chars[row->chunks[j].cx],
+                                         end - row->chunks[j].cx,
+                                         &row->chunks[j].power);
+  }
+}
+
+void editorRowHash(editorRow *row) {
+  uint64_t hash = 0, power;
+  if (row->numChunks == 0)
+    hash = editorHashSpan(row->chars, row->size, &power);
+  for (int j = 0; j < row->numChunks; j++)
+    hash = hash * row->chunks[j].power + row->chunks[j].hash;
+  row->hash = hash ? hash : 1;
+}
+
+void editorRowSplitChunks(editorRow *row) {
+  free(row->chunks);
+  row->chunks = NULL;
+  row->numChunks = 0;
+  if (row->size <= KILO_CHUNK_SIZE) return;
+
+  row->chunks = malloc(sizeof(editorChunk) * (row->size / KILO_CHUNK_SIZE + 1));
+  int cx = 0;
+  while (cx < row->size) {
+    row->chunks[row->numChunks++].cx = cx;
+    cx = editorRowChunkBoundary(row, cx + KILO_CHUNK_SIZE);
+  }
+  editorHashChunks(row, 0, row->numChunks);
+}
+
+void editorRenderRow(editorRow *row) {
+  int tabs;
+  row->isAscii = utf8ScanAscii(row->chars, row->size, &tabs);
+
+  if (!row->sharedRender) free(row->render);
+  row->sharedRender = (tabs == 0);
+  if (row->sharedRender)
+    row->render = row->chars;
+  else
+    row->render = malloc(row->size + (tabs * (KILO_TAB_STOP - 1)) + 1);
+
+  editorRowSplitChunks(row);
+  editorRowHash(row);
+  editorRowRenderFrom(row, 0);
+}
+
+void editorUpdateRow(editorRow *row) {
+  editorDiffTouch(row->idx, row->idx + 1);
+  editorRenderRow(row);
+  editorUpdateSyntax(row);
+}
+
+/* Updates a row after 'delta' bytes were inserted at 'at' (or -delta
+ * bytes removed from there). Long rows are only re-rendered from the
+ * chunk containing the edit and re-highlighted up to the first chunk
+ * whose checkpoint comes out unchanged. */
+void editorUpdateRowFrom(editorRow *row, int at, int delta) {
+  if (row->numChunks == 0 || row->size <= KILO_CHUNK_SIZE) {
+    editorUpdateRow(row);
+    return;
+  }
+  editorDiffTouch(row->idx, row->idx + 1);
+
+  editorChunk *old = row->chunks;
+  int oldNum = row->numChunks;
+  int k = editorRowFindChunk(row, offsetof(editorChunk, cx),
+                             delta > 0 ? at - 1 : at);
+
+  int next = k + 1;
+  while (next < oldNum && old[next].cx < at - delta) next++;
+  int end = (next < oldNum) ? old[next].cx + delta : row->size;
+  if (next < oldNum && end - old[k].cx < KILO_CHUNK_SIZE / 4) {
+    next++;
+    end = (next < oldNum) ? old[next].cx + delta : row->size;
+  }
+
+  int maxNum = oldNum + (end - old[k].cx) / KILO_CHUNK_SIZE + 1;
+  editorChunk *chunks = malloc(sizeof(editorChunk) * maxNum);
+  int *oldIdx = malloc(sizeof(int) * maxNum);
+  int num = 0;
+  for (int j = 0; j <= k; j++) {
+    chunks[num] = old[j];
+    oldIdx[num++] = -1;
+  }
+  if (end - old[k].cx > 2 * KILO_CHUNK_SIZE) {
+    int cx = editorRowChunkBoundary(row, old[k].cx + KILO_CHUNK_SIZE);
+    while (end - cx > KILO_CHUNK_SIZE) {
+      chunks[num].cx = cx;
+      oldIdx[num++] = -1;
+      cx = editorRowChunkBoundary(row, cx + KILO_CHUNK_SIZE);
+    }
+  }
+  int tail = num;
+  for (int j = next; j < oldNum; j++) {
+    chunks[num] = old[j];
+    chunks[num].cx += delta;
+    oldIdx[num++] = j;
+  }
+  row->chunks = chunks;
+  row->numChunks = num;
+  editorHashChunks(row, k, tail);
+  editorRowHash(row);
+
+  int tabs;
+  int renderAt = chunks[k].renderAt;
+  if (!utf8ScanAscii(&row->chars[chunks[k].cx], row->size - chunks[k].cx, &tabs))
+    row->isAscii = 0;
+  int renderSize = renderAt + (row->size - chunks[k].cx) +
+                   (tabs * (KILO_TAB_STOP - 1)) + 1;
+  if (row->sharedRender && tabs == 0)
+    row->render = row->chars;
+  else if (row->sharedRender) {
+    row->render = malloc(renderSize);
+    memcpy(row->render, row->chars, renderAt);
+    row->sharedRender = 0;
+  } else
+    row->render = realloc(row->render, renderSize);
+
+  int oldRenderSize = row->renderSize;
+  editorRowRenderFrom(row, k);
+  int shift = row->renderSize - oldRenderSize;
+
+  if (shift > 0) row->highlight = realloc(row->highlight, row->renderSize);
+
+  int reuse = 0;
+  if (tail < num) {
+    int from = old[oldIdx[tail]].renderAt;
+    int lowest = (k > 0) ? chunks[k - 1].highlightAt : 0;
+    if (from + shift >= lowest) {
+      memmove(&row->highlight[from + shift], &row->highlight[from],
+              oldRenderSize - from);
+      reuse = 1;
+    }
+  }
+  if (!reuse)
+    for (int j = 0; j < num; j++) oldIdx[j] = -1;
+
+  editorUpdateSyntaxFrom(row, k, old, oldIdx, shift);
+
+  if (shift < 0) row->highlight = realloc(row->highlight, row->renderSize);
+  free(oldIdx);
+  free(old);
+}
+
+void editorInitRow(editorRow *row, int idx, const char *s, int len) {
+  row->idx = idx;
+
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->renderSize = 0;
+  row->render = NULL;
+  row->sharedRender = 0;
+  row->highlight = NULL;
+  row->highlightOpenComment = 0;
+  row->chunks = NULL;
+  row->numChunks = 0;
+  row->brackets = NULL;
+  row->numBrackets = 0;
+  row->bracketsDirty = 1;
+  editorRenderRow(row);
+}
+
+void editorInsertRows(int at, char **lines, int *lens, int count) {
+  if (at < 0 || at > E.numRows || count <= 0) return;
+
+  E.row = realloc(E.row, sizeof(editorRow) * (E.numRows + count));
+  memmove(&E.row[at + count], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+  for (int i = at + count; i < E.numRows + count; i++) E.row[i].idx += count;
+
+  int openComment = (at > 0) ? E.row[at - 1].highlightOpenComment : 0;
+  for (int j = 0; j < count; j++) {
+    editorInitRow(&E.row[at + j], at + j, lines[j], lens[j]);
+    E.row[at + j].highlightOpenComment = openComment;
+    editorIndexWords(&E.row[at + j], 0, lens[j], 1);
+  }
+
+  E.numRows += count;
+  if (E.diffTo > at) E.diffTo += count;
+  editorDiffTouch(at, at + count);
+  editorBracketInsertRows(at, count);
+  editorShiftFolds(at, count);
+  editorUpdateSyntaxRows(at, at + count);
+  E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  int rowLen = len;
+  editorInsertRows(at, &s, &rowLen, 1);
+}
+
+void editorFreeRow(editorRow *row) {
+  if (!row->sharedRender) free(row->render);
+  free(row->chars);
+  free(row->highlight);
+  free(row->chunks);
+  free(row->brackets);
+}
+
+void editorDelRows(int at, int count) {
+  if (at < 0 || at >= E.numRows || count <= 0) return;
+  if (count > E.numRows - at) count = E.numRows - at;
+
+  int openComment = E.row[at + count - 1].highlightOpenComment;
+  for (int j = at; j < at + count; j++) {
+    editorIndexWords(&E.row[j], 0, E.row[j].size, -1);
+    editorFreeRow(&E.row[j]);
+  }
+  memmove(&E.row[at], &E.row[at + count],
+          sizeof(editorRow) * (E.numRows - at - count));
+  E.numRows -= count;
+  for (int i = at; i < E.numRows; i++) E.row[i].idx -= count;
+  if (E.diffTo > at) E.diffTo = (E.diffTo > at + count) ? E.diffTo - count : at;
+  editorDiffTouch(at, at);
+  editorBracketDelRows(at, count);
+  editorShiftFolds(at, -count);
+
+  int entry = (at > 0) ? E.row[at - 1].highlightOpenComment : 0;
+  if (at < E.numRows && entry != openComment)
+    editorUpdateSyntaxRows(at, at + 1);
+  E.dirty++;
+}
+
+void editorDelRow(int at) {
+  editorDelRows(at, 1);
 }
 
 void editorRowInsertChar(editorRow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
+  editorIndexWords(row, at, at, -1);
   row->chars = realloc(row->chars, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
-  editorUpdateRow(row);
+  editorIndexWords(row, at, at + 1, 1);
+  editorUpdateRowFrom(row, at, 1);
   E.dirty++;
 }
 
 void editorRowAppendString(editorRow *row, char *s, size_t len) {
+  editorIndexWords(row, row->size, row->size, -1);
   row->chars = realloc(row->chars, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
-  editorUpdateRow(row);
+  editorIndexWords(row, row->size - len, row->size, 1);
+  editorUpdateRowFrom(row, row->size - len, len);
   E.dirty++;
 }
 
 void editorRowDelChar(editorRow *row, int at) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
+  int len = editorRowNextChar(row, at) - at;
+  editorIndexWords(row, at, at + len, -1);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorIndexWords(row, at, at, 1);
+  editorUpdateRowFrom(row, at, -len);
   E.dirty++;
 }
 
@@ -518,48 +1658,1443 @@ void editorInsertNewLine() {
     editorRow *row = &E.row[E.cursorY];
     editorInsertRow(E.cursorY + 1, &row->chars[E.cursorX], row->size - E.cursorX);
     row = &E.row[E.cursorY];
+    int removed = row->size - E.cursorX;
+    editorIndexWords(row, E.cursorX, row->size, -1);
     row->size = E.cursorX;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorIndexWords(row, E.cursorX, E.cursorX, 1);
+    editorUpdateRowFrom(row, E.cursorX, -removed);
   }
   E.cursorY++;
   E.cursorX = 0;
 }
 
-void editorDelChar() {
-  if (E.cursorY == E.numRows) return;
-  if (E.cursorX == 0 && E.cursorY == 0) return;
+void editorDelChar() {
+  if (E.cursorY == E.numRows) return;
+  if (E.cursorX == 0 && E.cursorY == 0) return;
+
+  editorRow *row = &E.row[E.cursorY];
+  if (E.cursorX > 0) {
+    E.cursorX = editorRowPrevChar(row, E.cursorX);
+    editorRowDelChar(row, E.cursorX);
+  } else {
+    E.cursorX = E.row[E.cursorY - 1].size;
+    editorRowAppendString(&E.row[E.cursorY - 1], row->chars, row->size);
+    editorDelRow(E.cursorY);
+    E.cursorY--;
+  }
+}
+
+/*** selection ***/
+
+int editorSelection(int *start, int *end) {
+  if (E.selectActive) {
+    *start = (E.selectAnchor < E.cursorY) ? E.selectAnchor : E.cursorY;
+    *end = ((E.selectAnchor > E.cursorY) ? E.selectAnchor : E.cursorY) + 1;
+  } else {
+    *start = E.cursorY;
+    *end = E.cursorY + 1;
+  }
+  if (*end > E.numRows) *end = E.numRows;
+  return *start < *end;
+}
+
+int editorRowSelected(int fileRow) {
+  int start, end;
+  return E.selectActive && editorSelection(&start, &end) &&
+         fileRow >= start && fileRow < end;
+}
+
+void editorFreeClipboard() {
+  for (int j = 0; j < E.clipboardRows; j++) free(E.clipboard[j]);
+  free(E.clipboard);
+  free(E.clipboardLens);
+  E.clipboard = NULL;
+  E.clipboardLens = NULL;
+  E.clipboardRows = 0;
+}
+
+void editorCopySelection(int cut) {
+  int start, end;
+  if (!editorSelection(&start, &end)) return;
+
+  editorFreeClipboard();
+  E.clipboardRows = end - start;
+  E.clipboard = malloc(sizeof(char *) * E.clipboardRows);
+  E.clipboardLens = malloc(sizeof(int) * E.clipboardRows);
+  for (int j = 0; j < E.clipboardRows; j++) {
+    editorRow *row = &E.row[start + j];
+    E.clipboard[j] = malloc(row->size);
+    memcpy(E.clipboard[j], row->chars, row->size);
+    E.clipboardLens[j] = row->size;
+  }
+
+  if (cut) {
+    editorDelRows(start, end - start);
+    E.cursorY = start;
+    E.cursorX = 0;
+  }
+  E.selectActive = 0;
+  editorSetStatusMessage("%d lines %s", E.clipboardRows, cut ? "cut" : "copied");
+}
+
+void editorDelSelection() {
+  int start, end;
+  if (editorSelection(&start, &end)) {
+    editorDelRows(start, end - start);
+    E.cursorY = start;
+    E.cursorX = 0;
+  }
+  E.selectActive = 0;
+}
+
+void editorPaste() {
+  if (E.clipboardRows == 0) return;
+  editorInsertRows(E.cursorY, E.clipboard, E.clipboardLens, E.clipboardRows);
+  E.cursorX = 0;
+  E.selectActive = 0;
+  editorSetStatusMessage("%d lines pasted", E.clipboardRows);
+}
+
+void editorIndentSelection(int outdent) {
+  int start, end;
+  if (!editorSelection(&start, &end)) return;
+
+  for (int i = start; i < end; i++) {
+    editorRow *row = &E.row[i];
+    int delta;
+    if (outdent) {
+      delta = 0;
+      if (row->size > 0 && row->chars[0] == '\t') delta = 1;
+      else
+        while (delta < row->size && delta < KILO_TAB_STOP &&
+               row->chars[delta] == ' ')
+          delta++;
+      if (delta == 0) continue;
+      memmove(row->chars, &row->chars[delta], row->size - delta + 1);
+      row->size -= delta;
+      delta = -delta;
+    } else {
+      row->chars = realloc(row->chars, row->size + 2);
+      memmove(&row->chars[1], row->chars, row->size + 1);
+      row->chars[0] = '\t';
+      row->size++;
+      delta = 1;
+    }
+    if (i == E.cursorY) {
+      E.cursorX += delta;
+      if (E.cursorX < 0) E.cursorX = 0;
+    }
+    editorRenderRow(row);
+  }
+
+  editorDiffTouch(start, end);
+  editorUpdateSyntaxRows(start, end);
+  E.dirty++;
+}
+
+/*** brackets ***/
+
+int editorBracketType(char c, int *open) {
+  char *p = strchr("([{)]}", c);
+  *open = 0;
+  if (c == '\0' || p == NULL) return -1;
+  *open = (p - "([{)]}") < 3;
+  return (p - "([{)]}") % 3;
+}
+
+void editorBracketTouch(int pos);
+
+void editorMarkBrackets(editorRow *row) {
+  if (row->bracketsDirty) return;
+  row->bracketsDirty = 1;
+  if (E.bracketTreeValid) editorBracketTouch(row->idx);
+}
+
+void editorRowScanBrackets(editorRow *row) {
+  int count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    count = 0;
+    for (int i = 0; i < row->renderSize; i++) {
+      char c = row->render[i];
+      if (c != '(' && c != ')' && c != '[' && c != ']' && c != '{' && c != '}')
+        continue;
+      int hl = row->highlight[i];
+      if (hl == HL_COMMENT || hl == HL_MLCOMMENT || hl == HL_STRING) continue;
+      if (pass) row->brackets[count] = i;
+      count++;
+    }
+    if (pass == 0) {
+      free(row->brackets);
+      row->brackets = count ? malloc(sizeof(int) * count) : NULL;
+      if (count == 0) break;
+    }
+  }
+  row->numBrackets = count;
+  row->bracketsDirty = 0;
+}
+
+struct editorBracketSpan editorBracketJoin(struct editorBracketSpan a,
+                                           struct editorBracketSpan b) {
+  struct editorBracketSpan joined;
+  joined.sum = a.sum + b.sum;
+  joined.minPrefix = (a.sum + b.minPrefix < a.minPrefix) ? a.sum + b.minPrefix
+                                                          : a.minPrefix;
+  joined.maxSuffix = (b.sum + a.maxSuffix > b.maxSuffix) ? b.sum + a.maxSuffix
+                                                          : b.maxSuffix;
+  return joined;
+}
+
+void editorRowBracketSpans(editorRow *row, struct editorBracketSpan *spans) {
+  if (row->bracketsDirty) editorRowScanBrackets(row);
+  for (int j = 0; j < row->numBrackets; j++) {
+    int open;
+    int type = editorBracketType(row->render[row->brackets[j]], &open);
+    struct editorBracketSpan one = { open ? 1 : -1, open ? 0 : -1, open ? 1 : 0 };
+    spans[type] = editorBracketJoin(spans[type], one);
+  }
+}
+
+struct editorBracketSpan editorRowBracketSpan(editorRow *row, int type) {
+  struct editorBracketSpan spans[3];
+  memset(spans, 0, sizeof(spans));
+  editorRowBracketSpans(row, spans);
+  return spans[type];
+}
+
+int editorBracketNewNode(int rows) {
+  static unsigned int seed = 2463534242u;
+  int t = E.bracketFree;
+  if (t) {
+    E.bracketFree = E.bracketNodes[t].left;
+  } else {
+    if (E.numBracketNodes == E.bracketNodesCap) {
+      E.bracketNodesCap = E.bracketNodesCap ? E.bracketNodesCap * 2 : 64;
+      E.bracketNodes = realloc(E.bracketNodes,
+                               sizeof(struct editorBracketNode) * E.bracketNodesCap);
+    }
+    t = E.numBracketNodes++;
+  }
+
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  memset(node, 0, sizeof(*node));
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  node->priority = seed;
+  node->rows = node->size = rows;
+  node->dirty = node->blockDirty = 1;
+  return t;
+}
+
+void editorBracketFreeTree(int t) {
+  if (t == 0) return;
+  editorBracketFreeTree(E.bracketNodes[t].left);
+  editorBracketFreeTree(E.bracketNodes[t].right);
+  E.bracketNodes[t].left = E.bracketFree;
+  E.bracketFree = t;
+}
+
+void editorBracketPull(int t) {
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  struct editorBracketNode *left = &E.bracketNodes[node->left];
+  struct editorBracketNode *right = &E.bracketNodes[node->right];
+  node->size = left->size + node->rows + right->size;
+  for (int type = 0; type < 3; type++)
+    node->span[type] = editorBracketJoin(
+        editorBracketJoin(left->span[type], node->block[type]), right->span[type]);
+}
+
+int editorBracketMerge(int a, int b) {
+  if (a == 0) return b;
+  if (b == 0) return a;
+  if (E.bracketNodes[a].priority > E.bracketNodes[b].priority) {
+    int right = editorBracketMerge(E.bracketNodes[a].right, b);
+    E.bracketNodes[a].right = right;
+    E.bracketNodes[a].dirty |= E.bracketNodes[right].dirty;
+    editorBracketPull(a);
+    return a;
+  }
+  int left = editorBracketMerge(a, E.bracketNodes[b].left);
+  E.bracketNodes[b].left = left;
+  E.bracketNodes[b].dirty |= E.bracketNodes[left].dirty;
+  editorBracketPull(b);
+  return b;
+}
+
+/* Splits off the blocks lying entirely within the first k rows. */
+void editorBracketSplit(int t, int k, int *left, int *right) {
+  if (t == 0) {
+    *left = *right = 0;
+    return;
+  }
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  int before = E.bracketNodes[node->left].size + node->rows;
+  if (k >= before) {
+    editorBracketSplit(node->right, k - before, &node->right, right);
+    *left = t;
+  } else {
+    editorBracketSplit(node->left, k, left, &node->left);
+    *right = t;
+  }
+  editorBracketPull(t);
+}
+
+/* Returns a tree of fresh blocks covering 'rows' rows, each close to
+ * KILO_BRACKET_BLOCK rows long. */
+int editorBracketBuild(int rows) {
+  int numBlocks = (rows + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK;
+  int root = 0;
+  for (int j = 0; j < numBlocks; j++) {
+    int blockRows = (int) ((long long) rows * (j + 1) / numBlocks -
+                           (long long) rows * j / numBlocks);
+    root = editorBracketMerge(root, editorBracketNewNode(blockRows));
+  }
+  return root;
+}
+
+/* Finds the block holding row pos and the row it starts at. */
+int editorBracketBlockAt(int pos, int *start) {
+  int t = E.bracketRoot;
+  *start = 0;
+  while (t) {
+    struct editorBracketNode *node = &E.bracketNodes[t];
+    int leftSize = E.bracketNodes[node->left].size;
+    if (pos < leftSize) {
+      t = node->left;
+    } else if (pos < leftSize + node->rows || node->right == 0) {
+      *start += leftSize;
+      return t;
+    } else {
+      pos -= leftSize + node->rows;
+      *start += leftSize + node->rows;
+      t = node->right;
+    }
+  }
+  return 0;
+}
+
+/* Grows or shrinks the block holding row pos by delta rows and marks it
+ * for rescanning, fixing the sizes on the path to it. */
+void editorBracketResize(int t, int pos, int delta) {
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  int leftSize = E.bracketNodes[node->left].size;
+  if (pos < leftSize)
+    editorBracketResize(node->left, pos, delta);
+  else if (pos < leftSize + node->rows || node->right == 0) {
+    node->rows += delta;
+    node->blockDirty = 1;
+  } else
+    editorBracketResize(node->right, pos - leftSize - node->rows, delta);
+  node->dirty = 1;
+  node->size += delta;
+}
+
+void editorBracketTouch(int pos) {
+  if (E.bracketRoot) editorBracketResize(E.bracketRoot, pos, 0);
+}
+
+/* Replaces the blocks covering oldRows rows from 'start', which must be
+ * block boundaries, with fresh blocks covering newRows rows. */
+void editorBracketReplace(int start, int oldRows, int newRows) {
+  int left, middle, right;
+  editorBracketSplit(E.bracketRoot, start, &left, &right);
+  editorBracketSplit(right, oldRows, &middle, &right);
+  editorBracketFreeTree(middle);
+  E.bracketRoot = editorBracketMerge(editorBracketMerge(left,
+      editorBracketBuild(newRows)), right);
+}
+
+/* Called after count rows were inserted at 'at'. The block they went
+ * into grows in place, and is split into fresh blocks once it holds
+ * more than twice KILO_BRACKET_BLOCK rows. */
+void editorBracketInsertRows(int at, int count) {
+  if (!E.bracketTreeValid) return;
+  int total = E.bracketNodes[E.bracketRoot].size;
+  if (total == 0) {
+    editorBracketFreeTree(E.bracketRoot);
+    E.bracketRoot = editorBracketBuild(count);
+    return;
+  }
+
+  int pos = (at < total) ? at : total - 1;
+  int start;
+  int t = editorBracketBlockAt(pos, &start);
+  int rows = E.bracketNodes[t].rows;
+  if (rows + count <= 2 * KILO_BRACKET_BLOCK)
+    editorBracketResize(E.bracketRoot, pos, count);
+  else
+    editorBracketReplace(start, rows, rows + count);
+}
+
+/* Called after count rows were deleted at 'at'. A single block shrinks
+ * in place; otherwise the blocks involved, plus a neighbour if they
+ * would end up too short, are replaced by fresh blocks. */
+void editorBracketDelRows(int at, int count) {
+  if (!E.bracketTreeValid) return;
+  int total = E.bracketNodes[E.bracketRoot].size;
+  int start, lastStart;
+  int first = editorBracketBlockAt(at, &start);
+  int last = editorBracketBlockAt(at + count - 1, &lastStart);
+  int end = lastStart + E.bracketNodes[last].rows;
+  int remaining = end - start - count;
+
+  if (first == last && remaining > 0 &&
+      (remaining >= KILO_BRACKET_BLOCK / 2 || end - start == total)) {
+    editorBracketResize(E.bracketRoot, at, -count);
+    return;
+  }
+  if (remaining < KILO_BRACKET_BLOCK / 2) {
+    int neighbourStart;
+    if (end < total)
+      end += E.bracketNodes[editorBracketBlockAt(end, &neighbourStart)].rows;
+    else if (start > 0)
+      start -= E.bracketNodes[editorBracketBlockAt(start - 1, &neighbourStart)].rows;
+  }
+  editorBracketReplace(start, end - start, end - start - count);
+}
+
+void editorBracketRefresh(int t, int start) {
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  if (t == 0 || !node->dirty) return;
+  editorBracketRefresh(node->left, start);
+  int blockStart = start + E.bracketNodes[node->left].size;
+  if (node->blockDirty) {
+    memset(node->block, 0, sizeof(node->block));
+    for (int fileRow = blockStart; fileRow < blockStart + node->rows; fileRow++)
+      editorRowBracketSpans(&E.row[fileRow], node->block);
+    node->blockDirty = 0;
+  }
+  editorBracketRefresh(node->right, blockStart + node->rows);
+  node->dirty = 0;
+  editorBracketPull(t);
+}
+
+/* Brings the bracket tree up to date: a full build after a file was
+ * loaded, otherwise a rescan of the blocks touched since the last
+ * lookup. */
+void editorUpdateBracketTree() {
+  if (!E.bracketTreeValid) {
+    /* Node 0 is the empty tree: its size and spans stay zero. */
+    if (E.bracketNodesCap == 0) {
+      E.bracketNodesCap = 64;
+      E.bracketNodes = malloc(sizeof(struct editorBracketNode) * E.bracketNodesCap);
+    }
+    memset(&E.bracketNodes[0], 0, sizeof(struct editorBracketNode));
+    E.numBracketNodes = 1;
+    E.bracketFree = 0;
+    E.bracketRoot = editorBracketBuild(E.numRows);
+    E.bracketTreeValid = 1;
+  }
+  editorBracketRefresh(E.bracketRoot, 0);
+}
+
+/* Finds the first row at or after 'from' where the running bracket sum,
+ * starting at *sum, drops to -need or below. Whole subtrees and blocks
+ * that can't get there are skipped by adding their sum. */
+int editorBracketForward(int t, int start, int from, int type, int need,
+                         int *sum) {
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  if (t == 0 || start + node->size <= from) return -1;
+  if (start >= from && *sum + node->span[type].minPrefix > -need) {
+    *sum += node->span[type].sum;
+    return -1;
+  }
+
+  int found = editorBracketForward(node->left, start, from, type, need, sum);
+  if (found != -1) return found;
+  int blockStart = start + E.bracketNodes[node->left].size;
+  int blockEnd = blockStart + node->rows;
+  if (blockEnd > from) {
+    if (blockStart >= from && *sum + node->block[type].minPrefix > -need) {
+      *sum += node->block[type].sum;
+    } else {
+      for (int fileRow = (from > blockStart) ? from : blockStart;
+           fileRow < blockEnd; fileRow++) {
+        struct editorBracketSpan rowSpan = editorRowBracketSpan(&E.row[fileRow], type);
+        if (*sum + rowSpan.minPrefix <= -need) return fileRow;
+        *sum += rowSpan.sum;
+      }
+    }
+  }
+  return editorBracketForward(node->right, blockEnd, from, type, need, sum);
+}
+
+int editorBracketBackward(int t, int start, int to, int type, int need,
+                          int *sum) {
+  struct editorBracketNode *node = &E.bracketNodes[t];
+  if (t == 0 || start >= to) return -1;
+  if (start + node->size <= to && *sum + node->span[type].maxSuffix < need) {
+    *sum += node->span[type].sum;
+    return -1;
+  }
+
+  int blockStart = start + E.bracketNodes[node->left].size;
+  int blockEnd = blockStart + node->rows;
+  int found = editorBracketBackward(node->right, blockEnd, to, type, need, sum);
+  if (found != -1) return found;
+  if (blockStart < to) {
+    if (blockEnd <= to && *sum + node->block[type].maxSuffix < need) {
+      *sum += node->block[type].sum;
+    } else {
+      for (int fileRow = ((to < blockEnd) ? to : blockEnd) - 1;
+           fileRow >= blockStart; fileRow--) {
+        struct editorBracketSpan rowSpan = editorRowBracketSpan(&E.row[fileRow], type);
+        if (*sum + rowSpan.maxSuffix >= need) return fileRow;
+        *sum += rowSpan.sum;
+      }
+    }
+  }
+  return editorBracketBackward(node->left, start, to, type, need, sum);
+}
+
+/* Walks the brackets of one row from index j in direction dir until the
+ * depth returns to zero. Returns the bracket index, or -1 with the
+ * remaining depth left in *depth. */
+int editorRowMatchBracket(editorRow *row, int j, int dir, int type, int *depth) {
+  for (; j >= 0 && j < row->numBrackets; j += dir) {
+    int open;
+    if (editorBracketType(row->render[row->brackets[j]], &open) != type) continue;
+    *depth += (open == (dir > 0)) ? 1 : -1;
+    if (*depth == 0) return j;
+  }
+  return -1;
+}
+
+/* Finds the bracket matching bracket j of a row. Returns the row it is
+ * on and sets *match to its index there, or returns -1. The bracket tree
+ * must be up to date. */
+int editorFindMatchingBracket(int fileRow, int j, int *match) {
+  editorRow *row = &E.row[fileRow];
+  int open;
+  int type = editorBracketType(row->render[row->brackets[j]], &open);
+  int dir = open ? 1 : -1;
+  int depth = 1;
+  *match = editorRowMatchBracket(row, j + dir, dir, type, &depth);
+  if (*match != -1) return fileRow;
+
+  int sum = 0;
+  if (open)
+    fileRow = editorBracketForward(E.bracketRoot, 0, fileRow + 1, type,
+                                   depth, &sum);
+  else
+    fileRow = editorBracketBackward(E.bracketRoot, 0, fileRow, type,
+                                    depth, &sum);
+  if (fileRow == -1 || fileRow >= E.numRows) return -1;
+  row = &E.row[fileRow];
+  depth += open ? sum : -sum;
+  *match = editorRowMatchBracket(row, open ? 0 : row->numBrackets - 1, dir,
+                                 type, &depth);
+  return (*match == -1) ? -1 : fileRow;
+}
+
+void editorMatchBracket() {
+  if (E.cursorY >= E.numRows) return;
+  editorUpdateBracketTree();
+
+  editorRow *row = &E.row[E.cursorY];
+  int renderX = editorRowCxToRx(row, E.cursorX);
+  int j = -1;
+  for (int k = 0; k < row->numBrackets; k++) {
+    int rx = editorRowRenderToRx(row, row->brackets[k]);
+    if (rx == renderX || (rx == renderX - 1 && j == -1)) j = k;
+    if (rx >= renderX) break;
+  }
+  if (j == -1) {
+    editorSetStatusMessage("No bracket at cursor");
+    return;
+  }
+
+  int match;
+  int fileRow = editorFindMatchingBracket(E.cursorY, j, &match);
+  if (fileRow == -1) {
+    editorSetStatusMessage("No matching bracket");
+    return;
+  }
+
+  row = &E.row[fileRow];
+  E.cursorY = fileRow;
+  E.cursorX = editorRowRxToCx(row, editorRowRenderToRx(row, row->brackets[match]));
+}
+
+/*** folding ***/
+
+/* Folds are kept as a sorted array of disjoint intervals with a prefix
+ * sum of hidden rows, so mapping between file and screen rows is a
+ * binary search. Adding, removing or shifting folds rebuilds the sums in
+ * O(F) for F folds: folds are made by hand and stay few, and the row
+ * inserts and deletes that shift them already cost O(rows) for the row
+ * array, so a tree here would not make any edit cheaper. */
+void editorUpdateFoldSums() {
+  E.foldHidden = realloc(E.foldHidden, sizeof(int) * (E.numFolds + 1));
+  E.foldHidden[0] = 0;
+  for (int j = 0; j < E.numFolds; j++)
+    E.foldHidden[j + 1] = E.foldHidden[j] + E.folds[j].end - E.folds[j].start;
+}
+
+/* Returns the last fold whose header is at or above fileRow, or -1. */
+int editorFindFold(int fileRow) {
+  int lo = 0, hi = E.numFolds;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.folds[mid].start <= fileRow) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+int editorFoldAt(int fileRow) {
+  int j = editorFindFold(fileRow);
+  return (j != -1 && fileRow <= E.folds[j].end) ? j : -1;
+}
+
+/* Maps a file row to its screen line counted from the top of the file.
+ * Hidden rows map to the line of their fold's header. */
+int editorVisibleRow(int fileRow) {
+  int j = editorFindFold(fileRow);
+  if (j == -1) return fileRow;
+  if (fileRow <= E.folds[j].end) return E.folds[j].start - E.foldHidden[j];
+  return fileRow - E.foldHidden[j + 1];
+}
+
+int editorFileRow(int visibleRow) {
+  int lo = 0, hi = E.numFolds;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.folds[mid].start - E.foldHidden[mid] <= visibleRow) lo = mid + 1;
+    else hi = mid;
+  }
+  int j = lo - 1;
+  if (j == -1) return visibleRow;
+  if (visibleRow == E.folds[j].start - E.foldHidden[j]) return E.folds[j].start;
+  return visibleRow + E.foldHidden[j + 1];
+}
+
+int editorNextVisibleRow(int fileRow) {
+  return editorFileRow(editorVisibleRow(fileRow) + 1);
+}
+
+int editorPrevVisibleRow(int fileRow) {
+  return editorFileRow(editorVisibleRow(fileRow) - 1);
+}
+
+/* Hides rows (start, end]. Folds overlapping the range are merged into
+ * the new one. */
+void editorAddFold(int start, int end) {
+  int last = editorFindFold(end);
+  int first = last;
+  while (first >= 0 && E.folds[first].end >= start) first--;
+  first++;
+  if (first <= last) {
+    if (E.folds[first].start < start) start = E.folds[first].start;
+    if (E.folds[last].end > end) end = E.folds[last].end;
+  }
+
+  if (E.numFolds == E.foldsCap) {
+    E.foldsCap = E.foldsCap ? E.foldsCap * 2 : 16;
+    E.folds = realloc(E.folds, sizeof(struct editorFold) * E.foldsCap);
+  }
+  int removed = last - first + 1;
+  memmove(&E.folds[first + 1], &E.folds[last + 1],
+          sizeof(struct editorFold) * (E.numFolds - last - 1));
+  E.numFolds += 1 - removed;
+  E.folds[first].start = start;
+  E.folds[first].end = end;
+  editorUpdateFoldSums();
+}
+
+void editorRemoveFold(int j) {
+  memmove(&E.folds[j], &E.folds[j + 1],
+          sizeof(struct editorFold) * (E.numFolds - j - 1));
+  E.numFolds--;
+  editorUpdateFoldSums();
+}
+
+void editorClearFolds() {
+  E.numFolds = 0;
+  editorUpdateFoldSums();
+}
+
+int editorShiftFoldRow(int fileRow, int at, int delta, int isEnd) {
+  if (delta > 0) return (fileRow >= at) ? fileRow + delta : fileRow;
+  if (fileRow < at) return fileRow;
+  if (fileRow >= at - delta) return fileRow + delta;
+  return isEnd ? at - 1 : at;
+}
+
+/* Moves folds below an insertion of delta rows at 'at', or a deletion of
+ * -delta rows there. Rows inserted into a fold are hidden with it, and
+ * folds left with nothing to hide are dropped. */
+void editorShiftFolds(int at, int delta) {
+  if (E.numFolds == 0) return;
+  int first = editorFindFold(at);
+  if (first < 0) first = 0;
+
+  int num = first;
+  for (int j = first; j < E.numFolds; j++) {
+    struct editorFold fold = E.folds[j];
+    if (delta > 0 && fold.start < at && fold.end >= at)
+      fold.end += delta;
+    else {
+      fold.start = editorShiftFoldRow(fold.start, at, delta, 0);
+      fold.end = editorShiftFoldRow(fold.end, at, delta, 1);
+    }
+    if (fold.end > fold.start) E.folds[num++] = fold;
+  }
+  E.numFolds = num;
+  editorUpdateFoldSums();
+}
+
+int editorRowIndent(editorRow *row) {
+  int indent = 0;
+  while (indent < row->renderSize && row->render[indent] == ' ') indent++;
+  return indent;
+}
+
+/* Returns the row before the one closing the last bracket opened on
+ * fileRow, so that the closing line stays visible, or -1. */
+int editorBracketFoldEnd(int fileRow) {
+  editorUpdateBracketTree();
+  editorRow *row = &E.row[fileRow];
+  for (int j = row->numBrackets - 1; j >= 0; j--) {
+    int open, match;
+    if (editorBracketType(row->render[row->brackets[j]], &open) == -1 ||
+        !open)
+      continue;
+    int end = editorFindMatchingBracket(fileRow, j, &match);
+    if (end > fileRow) return end - 1;
+  }
+  return -1;
+}
+
+/* Returns the last row of the block indented deeper than fileRow. */
+int editorIndentFoldEnd(int fileRow) {
+  int indent = editorRowIndent(&E.row[fileRow]);
+  if (indent == E.row[fileRow].renderSize) return -1;
+
+  int end = fileRow;
+  for (int i = fileRow + 1; i < E.numRows; i++) {
+    int rowIndent = editorRowIndent(&E.row[i]);
+    if (rowIndent == E.row[i].renderSize) continue;
+    if (rowIndent <= indent) break;
+    end = i;
+  }
+  return end;
+}
+
+/* Opens the fold under the cursor, or folds the selected lines, else the
+ * bracket block opened on the cursor line, else its indented block. */
+void editorToggleFold() {
+  if (E.cursorY >= E.numRows) return;
+
+  int j = editorFoldAt(E.cursorY);
+  if (j != -1) {
+    editorRemoveFold(j);
+    return;
+  }
+
+  int start = E.cursorY, end;
+  int selStart, selEnd;
+  if (E.selectActive && editorSelection(&selStart, &selEnd) &&
+      selEnd - selStart > 1) {
+    start = selStart;
+    end = selEnd - 1;
+    E.selectActive = 0;
+  } else {
+    end = editorBracketFoldEnd(start);
+    if (end <= start) end = editorIndentFoldEnd(start);
+  }
+  if (end <= start) {
+    editorSetStatusMessage("Nothing to fold");
+    return;
+  }
+
+  editorAddFold(start, end);
+  E.cursorY = start;
+  if (E.cursorX > E.row[start].size) E.cursorX = E.row[start].size;
+}
+
+/*** completion ***/
+
+void editorCloseCompletion() {
+  for (int j = 0; j < E.numCompletions; j++) free(E.completions[j]);
+  E.numCompletions = 0;
+}
+
+/* Best-first search over the trie: a queue entry is either a subtree,
+ * ranked by the highest count below it, or a word, ranked by its own
+ * count. Words therefore come out most frequent first, and only the
+ * subtrees that can still beat them are ever expanded. */
+struct editorWordEntry {
+  int node;
+  int parent;
+  int key;
+  int isWord;
+};
+
+struct editorWordQueue {
+  struct editorWordEntry *entries;
+  int numEntries, cap;
+  int *heap;
+  int numHeap;
+};
+
+void editorWordPush(struct editorWordQueue *q, int node, int parent, int key,
+                    int isWord) {
+  if (q->numEntries == q->cap) {
+    q->cap = q->cap ? q->cap * 2 : 64;
+    q->entries = realloc(q->entries, sizeof(struct editorWordEntry) * q->cap);
+    q->heap = realloc(q->heap, sizeof(int) * q->cap);
+  }
+  int e = q->numEntries++;
+  q->entries[e] = (struct editorWordEntry) { node, parent, key, isWord };
+
+  int i = q->numHeap++;
+  while (i > 0 && q->entries[q->heap[(i - 1) / 2]].key < key) {
+    q->heap[i] = q->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  q->heap[i] = e;
+}
+
+int editorWordPop(struct editorWordQueue *q) {
+  int top = q->heap[0];
+  int last = q->heap[--q->numHeap];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= q->numHeap) break;
+    if (child + 1 < q->numHeap &&
+        q->entries[q->heap[child + 1]].key > q->entries[q->heap[child]].key)
+      child++;
+    if (q->entries[q->heap[child]].key <= q->entries[last].key) break;
+    q->heap[i] = q->heap[child];
+    i = child;
+  }
+  q->heap[i] = last;
+  return top;
+}
+
+/* Spells out the word of a queue entry: the prefix followed by the
+ * characters of the subtrees between the prefix node and the word. */
+char *editorWordEntryString(struct editorWordQueue *q, int e,
+                            const char *prefix, int prefixLen) {
+  int len = prefixLen;
+  for (int p = q->entries[e].parent; q->entries[p].parent != -1;
+       p = q->entries[p].parent)
+    len++;
+  char *word = malloc(len + 1);
+  memcpy(word, prefix, prefixLen);
+  word[len] = '\0';
+  for (int p = q->entries[e].parent; q->entries[p].parent != -1;
+       p = q->entries[p].parent)
+    word[--len] = E.words[q->entries[p].node].c;
+  return word;
+}
+
+/* Looks up words starting with the word before the cursor and keeps the
+ * most frequent ones for the popup. */
+void editorComplete() {
+  editorCloseCompletion();
+  if (E.cursorY >= E.numRows) return;
+
+  editorRow *row = &E.row[E.cursorY];
+  int start = E.cursorX;
+  while (start > 0 && editorIsWordChar(row->chars[start - 1])) start--;
+  int prefixLen = E.cursorX - start;
+  if (prefixLen == 0 || prefixLen >= KILO_MAX_WORD) return;
+
+  int node = 0;
+  for (int j = 0; j < prefixLen && node != -1; j++) {
+    int child = editorWordChild(node, row->chars[start + j]);
+    node = child ? child : -1;
+  }
+  if (node == -1) {
+    editorSetStatusMessage("No completions");
+    return;
+  }
+
+  struct editorWordQueue q = { NULL, 0, 0, NULL, 0 };
+  editorWordPush(&q, node, -1, E.words[node].best, 0);
+  while (q.numHeap && E.numCompletions < KILO_MAX_COMPLETIONS) {
+    int e = editorWordPop(&q);
+    struct editorWordEntry entry = q.entries[e];
+    if (entry.key <= 0) break;
+    if (entry.isWord) {
+      E.completions[E.numCompletions++] =
+          editorWordEntryString(&q, e, &row->chars[start], prefixLen);
+      continue;
+    }
+    /* The prefix itself is not offered as its own completion. */
+    if (entry.parent != -1 && E.words[entry.node].count > 0)
+      editorWordPush(&q, entry.node, e, E.words[entry.node].count, 1);
+    for (int child = E.words[entry.node].child; child;
+         child = E.words[child].next)
+      if (E.words[child].best > 0)
+        editorWordPush(&q, child, e, E.words[child].best, 0);
+  }
+  free(q.entries);
+  free(q.heap);
+
+  E.completionIndex = 0;
+  E.completionPrefixLen = prefixLen;
+  if (E.numCompletions == 0) editorSetStatusMessage("No completions");
+}
+
+/* Handles a key while the popup is open. Returns 1 if it was consumed;
+ * any other key closes the popup and is processed as usual. */
+int editorCompletionKey(int c) {
+  switch (c) {
+    case CTRL_KEY('n'):
+    case ARROW_DOWN:
+      E.completionIndex = (E.completionIndex + 1) % E.numCompletions;
+      return 1;
+    case CTRL_KEY('p'):
+    case ARROW_UP:
+      E.completionIndex = (E.completionIndex + E.numCompletions - 1) %
+                          E.numCompletions;
+      return 1;
+    case '\r':
+    case '\t':
+      {
+        char *word = E.completions[E.completionIndex];
+        for (int j = E.completionPrefixLen; word[j]; j++)
+          editorInsertChar((unsigned char) word[j]);
+        editorCloseCompletion();
+      }
+      return 1;
+    case '\x1b':
+      editorCloseCompletion();
+      return 1;
+  }
+  editorCloseCompletion();
+  return 0;
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *bufLen) {
+  int totLen = 0;
+  for (int i = 0; i < E.numRows; i++)
+    totLen += E.row[i].size + 1;
+  *bufLen = totLen;
+
+  char *buf = malloc(totLen);
+  char *p = buf;
+  for (int i = 0; i < E.numRows; i++) {
+    memcpy(p, E.row[i].chars, E.row[i].size);
+    p += E.row[i].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+void editorReadRows(FILE *fp, int appendToLast) {
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    E.fileEndsWithNewline = (line[linelen - 1] == '\n');
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    if (appendToLast && E.numRows > 0)
+      editorRowAppendString(&E.row[E.numRows - 1], line, linelen);
+    else
+      editorInsertRow(E.numRows, line, linelen);
+    appendToLast = 0;
+  }
+  free(line);
+}
+
+struct editorLoadJob {
+  const char *start, *end;
+  int speculate;
+  editorRow *rows;
+  int numRows;
+  editorRow *alt;
+  int numAlt;
+  int altConverged;
+};
+
+/* Splits one slice of the file into rows and highlights them assuming
+ * the slice starts outside a comment. The rows are also highlighted as
+ * if it started inside one, until both passes end a row in the same
+ * state; from there on the two would be identical. */
+void *editorLoadWorker(void *arg) {
+  struct editorLoadJob *job = arg;
+  int cap = 0;
+  const char *p = job->start;
+  while (p < job->end) {
+    const char *newline = memchr(p, '\n', job->end - p);
+    int len = (newline ? newline : job->end) - p;
+    while (len > 0 && p[len - 1] == '\r') len--;
+
+    if (job->numRows == cap) {
+      cap = cap ? cap * 2 : 1024;
+      job->rows = realloc(job->rows, sizeof(editorRow) * cap);
+    }
+    editorInitRow(&job->rows[job->numRows], job->numRows, p, len);
+    job->numRows++;
+    p = newline ? newline + 1 : job->end;
+  }
+
+  int inComment = 0;
+  for (int i = 0; i < job->numRows; i++) {
+    struct editorLexState state = { inComment, 0, 1, 0 };
+    editorHighlightRowFrom(&job->rows[i], &state);
+    job->rows[i].highlightOpenComment = inComment = state.inComment;
+    editorRowScanBrackets(&job->rows[i]);
+  }
+
+  job->altConverged = !job->speculate;
+  if (!job->speculate) return NULL;
+
+  job->alt = malloc(sizeof(editorRow) * KILO_SPECULATE_ROWS);
+  inComment = 1;
+  for (int i = 0; i < job->numRows && i < KILO_SPECULATE_ROWS; i++) {
+    editorRow *alt = &job->alt[job->numAlt++];
+    *alt = job->rows[i];
+    alt->highlight = NULL;
+    if (alt->numChunks) {
+      alt->chunks = malloc(sizeof(editorChunk) * alt->numChunks);
+      memcpy(alt->chunks, job->rows[i].chunks, sizeof(editorChunk) * alt->numChunks);
+    }
+
+    struct editorLexState state = { inComment, 0, 1, 0 };
+    editorHighlightRowFrom(alt, &state);
+    alt->highlightOpenComment = inComment = state.inComment;
+    if (inComment == job->rows[i].highlightOpenComment) {
+      job->altConverged = 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+int editorLoadThreads(size_t size) {
+  int numJobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numJobs > (int) (size / KILO_PARALLEL_MIN)) numJobs = size / KILO_PARALLEL_MIN;
+  if (numJobs > KILO_MAX_THREADS) numJobs = KILO_MAX_THREADS;
+  if (numJobs < 1) numJobs = 1;
+  return numJobs;
+}
+
+void editorRunJobs(void *(*worker)(void *), void *jobs, size_t jobSize,
+                   int numJobs) {
+  pthread_t threads[KILO_MAX_THREADS];
+  int started[KILO_MAX_THREADS];
+  for (int j = 1; j < numJobs; j++)
+    started[j] = (pthread_create(&threads[j], NULL, worker,
+                                 (char *) jobs + j * jobSize) == 0);
+  worker(jobs);
+  for (int j = 1; j < numJobs; j++) {
+    if (started[j]) pthread_join(threads[j], NULL);
+    else worker((char *) jobs + j * jobSize);
+  }
+}
+
+void editorLoadMapped(const char *data, size_t size) {
+  int numJobs = editorLoadThreads(size);
+  int speculate = E.syntax && E.syntax->lexer->mcsLen;
+  struct editorLoadJob jobs[KILO_MAX_THREADS];
+  const char *end = data + size;
+  const char *start = data;
+  for (int j = 0; j < numJobs; j++) {
+    const char *next = end;
+    if (j + 1 < numJobs) {
+      next = memchr(data + size / numJobs * (j + 1), '\n',
+                    size - size / numJobs * (j + 1));
+      next = next ? next + 1 : end;
+      if (next < start) next = start;
+    }
+    memset(&jobs[j], 0, sizeof(jobs[j]));
+    jobs[j].start = start;
+    jobs[j].end = next;
+    jobs[j].speculate = (j > 0 && speculate);
+    start = next;
+  }
+  editorRunJobs(editorLoadWorker, jobs, sizeof(jobs[0]), numJobs);
+
+  int total = 0;
+  for (int j = 0; j < numJobs; j++) total += jobs[j].numRows;
+  E.row = realloc(E.row, sizeof(editorRow) * total);
+  E.numRows = 0;
+  for (int j = 0; j < numJobs; j++) {
+    struct editorLoadJob *job = &jobs[j];
+    int at = E.numRows;
+    memcpy(&E.row[at], job->rows, sizeof(editorRow) * job->numRows);
+    for (int i = 0; i < job->numRows; i++) E.row[at + i].idx = at + i;
+    E.numRows += job->numRows;
+
+    int entry = (at > 0) ? E.row[at - 1].highlightOpenComment : 0;
+    for (int i = 0; i < job->numAlt; i++) {
+      editorRow *row = &E.row[at + i];
+      editorRow *alt = &job->alt[i];
+      if (entry) {
+        free(row->highlight);
+        if (row->numChunks) free(row->chunks);
+        row->highlight = alt->highlight;
+        row->chunks = alt->chunks;
+        row->highlightOpenComment = alt->highlightOpenComment;
+        row->bracketsDirty = 1;
+      } else {
+        free(alt->highlight);
+        if (alt->numChunks) free(alt->chunks);
+      }
+    }
+    if (entry && !job->altConverged && job->numAlt < job->numRows)
+      editorUpdateSyntaxRows(at + job->numAlt, at + job->numAlt + 1);
+
+    free(job->rows);
+    free(job->alt);
+  }
+
+  E.fileEndsWithNewline = (size == 0 || data[size - 1] == '\n');
+}
+
+struct editorIndexHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t mtimeSec, mtimeNsec;
+  uint64_t ctimeSec, ctimeNsec;
+  uint64_t ino, dev;
+  uint64_t syntaxId;
+  uint64_t numRows;
+};
+
+struct editorIndexJob {
+  const struct editorIndexHeader *index;
+  const char *data;
+  int from, to;
+  int built;
+  int *failed;
+};
+
+uint64_t editorSyntaxId() {
+  struct editorSyntax *syntax = E.syntax;
+  if (syntax == NULL) return 0;
+
+  char buf[512 + 256];
+  int len = snprintf(buf, 512, "%s|%s|%s|%s|%d", syntax->filetype,
+      syntax->singleLineCommentStart ? syntax->singleLineCommentStart : "",
+      syntax->multiLineCommentStart ? syntax->multiLineCommentStart : "",
+      syntax->multiLineCommentEnd ? syntax->multiLineCommentEnd : "",
+      syntax->flags);
+  if (len > 511) len = 511;
+  memcpy(&buf[len], syntax->lexer->charClass, 256);
+  return editorHashBytes(buf, len + 256);
+}
+
+int editorIndexPath(char *path, size_t size) {
+  char *file = realpath(E.filename, NULL);
+  if (file == NULL) return 0;
+  uint64_t hash = editorHashBytes(file, strlen(file));
+  free(file);
+
+  char dir[PATH_MAX];
+  char *cache = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (cache && *cache)
+    snprintf(dir, sizeof(dir), "%s", cache);
+  else if (home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return 0;
+  mkdir(dir, 0700);
+  strncat(dir, "/kilo", sizeof(dir) - strlen(dir) - 1);
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) return 0;
+
+  return snprintf(path, size, "%s/%016llx.idx", dir,
+                  (unsigned long long) hash) < (int) size;
+}
+
+void editorIndexHeaderInit(struct editorIndexHeader *header, struct stat *st) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, "KILOIDX2", 8);
+  header->size = st->st_size;
+  header->mtimeSec = st->st_mtim.tv_sec;
+  header->mtimeNsec = st->st_mtim.tv_nsec;
+  header->ctimeSec = st->st_ctim.tv_sec;
+  header->ctimeNsec = st->st_ctim.tv_nsec;
+  header->ino = st->st_ino;
+  header->dev = st->st_dev;
+  header->syntaxId = editorSyntaxId();
+}
+
+/* Builds rows [from, to) from the cached line offsets. Every row starts
+ * in the comment state recorded for the row above it, so ranges can be
+ * built independently. Returns 0 if the index doesn't match the data. */
+/* Builds rows [from, to) from the index. Returns how many were built
+ * before a row failed to match the file or another range did, setting
+ * 'failed' in the first case. */
+int editorLoadIndexedRows(const struct editorIndexHeader *index,
+                          const char *data, int from, int to, int *failed) {
+  const uint64_t *offsets = (const uint64_t *) (index + 1);
+  const unsigned char *bits = (const unsigned char *) (offsets + index->numRows);
+  for (int i = from; i < to; i++) {
+    if (__atomic_load_n(failed, __ATOMIC_RELAXED)) return i - from;
+    uint64_t start = offsets[i];
+    uint64_t end = (i + 1 < (int) index->numRows) ? offsets[i + 1] : index->size;
+    if (start >= end || end > index->size ||
+        (i + 1 < (int) index->numRows && data[end - 1] != '\n') ||
+        memchr(&data[start], '\n', end - start - 1)) {
+      __atomic_store_n(failed, 1, __ATOMIC_RELAXED);
+      return i - from;
+    }
+
+    int len = end - start;
+    if (data[start + len - 1] == '\n') len--;
+    while (len > 0 && data[start + len - 1] == '\r') len--;
+    editorInitRow(&E.row[i], i, &data[start], len);
+
+    struct editorLexState state = {
+      i > 0 && (bits[(i - 1) / 8] & (1 << ((i - 1) % 8))), 0, 1, 0
+    };
+    editorHighlightRowFrom(&E.row[i], &state);
+    E.row[i].highlightOpenComment = state.inComment;
+    editorRowScanBrackets(&E.row[i]);
+    if (state.inComment != ((bits[i / 8] >> (i % 8)) & 1)) {
+      editorFreeRow(&E.row[i]);
+      __atomic_store_n(failed, 1, __ATOMIC_RELAXED);
+      return i - from;
+    }
+  }
+  return to - from;
+}
+
+void *editorIndexWorker(void *arg) {
+  struct editorIndexJob *job = arg;
+  job->built = editorLoadIndexedRows(job->index, job->data, job->from,
+                                     job->to, job->failed);
+  return NULL;
+}
+
+/* Loads the file using a cached index. The rows on the first screen are
+ * built and painted before the rest, which is then built in parallel. */
+int editorLoadIndexed(const char *data, struct stat *st, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat indexSt;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &indexSt) == 0 &&
+      indexSt.st_size >= (off_t) sizeof(struct editorIndexHeader))
+    map = mmap(NULL, indexSt.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  struct editorIndexHeader expected;
+  editorIndexHeaderInit(&expected, st);
+  const struct editorIndexHeader *index = map;
+  uint64_t numRows = index->numRows;
+  expected.numRows = numRows;
+  if (memcmp(index, &expected, sizeof(expected)) || numRows == 0 ||
+      numRows > INT_MAX || numRows > index->size ||
+      (uint64_t) indexSt.st_size != sizeof(expected) + numRows * 8 + (numRows + 7) / 8 ||
+      ((const uint64_t *) (index + 1))[0] != 0) {
+    munmap(map, indexSt.st_size);
+    return 0;
+  }
+
+  E.row = malloc(sizeof(editorRow) * numRows);
+  int first = ((int) numRows < E.screenRows) ? (int) numRows : E.screenRows;
+  if (first < 0) first = 0;
+  int failed = 0;
+  int built = editorLoadIndexedRows(index, data, 0, first, &failed);
+  if (!failed && E.rowOffset == 0 && E.cursorY < first) {
+    /* The saved state is only recorded once every row is loaded, so this
+     * paint must not diff the rows against the old one. */
+    E.numRows = first;
+    editorClearDiff();
+    editorRefreshScreen();
+  }
+
+  int numJobs = failed ? 0 : editorLoadThreads(index->size);
+  struct editorIndexJob jobs[KILO_MAX_THREADS];
+  int rows = numRows - first;
+  for (int j = 0; j < numJobs; j++) {
+    jobs[j].index = index;
+    jobs[j].data = data;
+    jobs[j].from = first + (int) ((long long) rows * j / numJobs);
+    jobs[j].to = first + (int) ((long long) rows * (j + 1) / numJobs);
+    jobs[j].failed = &failed;
+  }
+  if (numJobs) editorRunJobs(editorIndexWorker, jobs, sizeof(jobs[0]), numJobs);
+
+  munmap(map, indexSt.st_size);
+  if (failed) {
+    for (int i = 0; i < built; i++) editorFreeRow(&E.row[i]);
+    for (int j = 0; j < numJobs; j++)
+      for (int i = jobs[j].from; i < jobs[j].from + jobs[j].built; i++)
+        editorFreeRow(&E.row[i]);
+    free(E.row);
+    E.row = NULL;
+    E.numRows = 0;
+    return 0;
+  }
+  E.numRows = numRows;
+  E.fileEndsWithNewline = (data[st->st_size - 1] == '\n');
+  return 1;
+}
+
+void editorSaveIndex(const char *data, struct stat *st, const char *path) {
+  struct editorIndexHeader header;
+  editorIndexHeaderInit(&header, st);
+  header.numRows = E.numRows;
+
+  uint64_t *offsets = malloc(sizeof(uint64_t) * E.numRows);
+  unsigned char *bits = calloc((E.numRows + 7) / 8, 1);
+  const char *p = data, *end = data + st->st_size;
+  int numRows = 0;
+  while (p < end && numRows < E.numRows) {
+    offsets[numRows] = p - data;
+    if (E.row[numRows].highlightOpenComment)
+      bits[numRows / 8] |= 1 << (numRows % 8);
+    numRows++;
+    const char *newline = memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+  }
+
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+  FILE *fp = (numRows == E.numRows && p == end) ? fopen(tmp, "w") : NULL;
+  if (fp) {
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(offsets, sizeof(uint64_t), numRows, fp) == (size_t) numRows &&
+             fwrite(bits, 1, (numRows + 7) / 8, fp) == (size_t) (numRows + 7) / 8;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, path) == -1) unlink(tmp);
+  }
+  free(offsets);
+  free(bits);
+}
+
+struct editorWordCount {
+  const char *word;
+  int len;
+  int count;
+};
+
+struct editorWordJob {
+  int from, to;
+  struct editorWordCount *table;
+  int size, cap;
+};
+
+struct editorWordCount *editorWordSlot(struct editorWordJob *job,
+                                       const char *word, int len) {
+  int mask = job->cap - 1;
+  int j = editorHashBytes(word, len) & mask;
+  while (job->table[j].word && (job->table[j].len != len ||
+                                memcmp(job->table[j].word, word, len)))
+    j = (j + 1) & mask;
+  return &job->table[j];
+}
+
+void editorCountWord(struct editorWordJob *job, const char *word, int len) {
+  if (job->size * 2 >= job->cap) {
+    struct editorWordCount *old = job->table;
+    int oldCap = job->cap;
+    job->cap = oldCap ? oldCap * 2 : 4096;
+    job->table = calloc(job->cap, sizeof(struct editorWordCount));
+    for (int j = 0; j < oldCap; j++)
+      if (old[j].word) *editorWordSlot(job, old[j].word, old[j].len) = old[j];
+    free(old);
+  }
 
-  editorRow *row = &E.row[E.cursorY];
-  if (E.cursorX > 0) {
-    editorRowDelChar(row, E.cursorX - 1);
-    E.cursorX--;
-  } else {
-    E.cursorX = E.row[E.cursorY - 1].size;
-    editorRowAppendString(&E.row[E.cursorY - 1], row->chars, row->size);
-    editorDelRow(E.cursorY);
-    E.cursorY--;
+  struct editorWordCount *slot = editorWordSlot(job, word, len);
+  if (slot->word == NULL) {
+    slot->word = word;
+    slot->len = len;
+    job->size++;
   }
+  slot->count++;
 }
 
-/*** file i/o ***/
+void *editorWordWorker(void *arg) {
+  struct editorWordJob *job = arg;
+  for (int i = job->from; i < job->to; i++) {
+    editorRow *row = &E.row[i];
+    int at = 0;
+    while (at < row->size) {
+      while (at < row->size && !editorIsWordChar(row->chars[at])) at++;
+      int start = at;
+      while (at < row->size && editorIsWordChar(row->chars[at])) at++;
+      if (at - start >= KILO_MIN_WORD && at - start <= KILO_MAX_WORD)
+        editorCountWord(job, &row->chars[start], at - start);
+    }
+  }
+  return NULL;
+}
 
-char *editorRowsToString(int *bufLen) {
-  int totLen = 0;
-  for (int i = 0; i < E.numRows; i++)
-    totLen += E.row[i].size + 1;
-  *bufLen = totLen;
+/* Fills the word index for a freshly loaded large file. Words are counted
+ * per slice on all cores, so only the distinct words of each slice have
+ * to be merged into the trie. */
+void editorIndexAllWords(size_t size) {
+  int numJobs = editorLoadThreads(size);
+  struct editorWordJob jobs[KILO_MAX_THREADS];
+  for (int j = 0; j < numJobs; j++) {
+    memset(&jobs[j], 0, sizeof(jobs[j]));
+    jobs[j].from = (int) ((long long) E.numRows * j / numJobs);
+    jobs[j].to = (int) ((long long) E.numRows * (j + 1) / numJobs);
+  }
+  editorRunJobs(editorWordWorker, jobs, sizeof(jobs[0]), numJobs);
+
+  for (int j = 0; j < numJobs; j++) {
+    for (int k = 0; k < jobs[j].cap; k++)
+      if (jobs[j].table[k].word)
+        editorWordAdd(jobs[j].table[k].word, jobs[j].table[k].len,
+                      jobs[j].table[k].count);
+    free(jobs[j].table);
+  }
+}
 
-  char *buf = malloc(totLen);
-  char *p = buf;
-  for (int i = 0; i < E.numRows; i++) {
-    memcpy(p, E.row[i].chars, E.row[i].size);
-    p += E.row[i].size;
-    *p = '\n';
-    p++;
+/* Loads the whole file into an empty buffer. Large files are split and
+ * highlighted on all cores, or rebuilt from the on-disk index cache when
+ * one matches the file. The stream is left just past the loaded data. */
+void editorLoadRows(FILE *fp) {
+  E.bracketTreeValid = 0;
+  editorResetWords();
+  editorClearFolds();
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && st.st_size >= KILO_PARALLEL_MIN) {
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (data != MAP_FAILED) {
+      char path[PATH_MAX];
+      int cached = editorIndexPath(path, sizeof(path));
+      if (!cached || !editorLoadIndexed(data, &st, path)) {
+        editorLoadMapped(data, st.st_size);
+        if (cached) editorSaveIndex(data, &st, path);
+      }
+      munmap(data, st.st_size);
+      editorIndexAllWords(st.st_size);
+      fseeko(fp, st.st_size, SEEK_SET);
+      return;
+    }
   }
+  editorReadRows(fp, 0);
+}
 
-  return buf;
+/* Remembers the hash of every row as the saved state that the diff
+ * gutter compares against. */
+void editorMarkSaved() {
+  E.savedHashes = realloc(E.savedHashes, sizeof(uint64_t) * (E.numRows + 1));
+  for (int i = 0; i < E.numRows; i++) E.savedHashes[i] = E.row[i].hash;
+  E.numSavedRows = E.numRows;
+  E.dirty = 0;
+  E.diffEdits = -1;
+  E.diffFrom = E.numRows;
+  E.diffTo = 0;
+}
+
+void editorRecordFileStat() {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1) return;
+  E.fileSize = st.st_size;
+  E.fileIno = st.st_ino;
+  E.fileMtime = st.st_mtim;
 }
 
 void editorOpen(char *filename) {
@@ -571,18 +3106,15 @@ void editorOpen(char *filename) {
   FILE *fp = fopen(filename, "r");
   if (!fp) die("fopen");
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numRows, line, linelen);
-  }
-  free(line);
+  E.fileEndsWithNewline = 1;
+  editorLoadRows(fp);
+  off_t loaded = ftello(fp);
   fclose(fp);
-  E.dirty = 0;
+  editorMarkSaved();
+
+  editorRecordFileStat();
+  E.fileSize = loaded;
+  editorWatchFile();
 }
 
 void editorSave() {
@@ -593,6 +3125,7 @@ void editorSave() {
       return;
     }
     editorSelectSyntaxHighlight();
+    editorWatchFile();
   }
 
   int len;
@@ -604,7 +3137,9 @@ void editorSave() {
       if (write(fd, buf, len) == len) {
         close(fd);
         free(buf);
-        E.dirty = 0;
+        editorMarkSaved();
+        E.fileEndsWithNewline = 1;
+        editorRecordFileStat();
         editorSetStatusMessage("%d bytes written to disk", len);
         return;
       }
@@ -616,6 +3151,155 @@ void editorSave() {
   editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
+/*** file watching ***/
+
+void editorWatchFile() {
+  if (E.watchFd == -1) {
+    E.watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.watchFd == -1) return;
+  }
+  if (E.watchWd != -1) inotify_rm_watch(E.watchFd, E.watchWd);
+  if (E.watchDirWd != -1) inotify_rm_watch(E.watchFd, E.watchDirWd);
+
+  E.watchWd = inotify_add_watch(E.watchFd, E.filename,
+      IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+
+  char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+  E.watchDirWd = inotify_add_watch(E.watchFd, dir, IN_CREATE | IN_MOVED_TO);
+  free(dir);
+}
+
+/* Checks that the file still ends with the last row as it was read, so
+ * that growth can be loaded as an append. The row lost its line ending:
+ * a complete line may have ended in "\r\n" or "\n", while a partial one
+ * ends in the row's own bytes. */
+int editorTailMatches() {
+  if (E.numRows == 0) return 0;
+
+  editorRow *row = &E.row[E.numRows - 1];
+  int size = (row->size < 4096) ? row->size : 4096;
+  int len = size + (E.fileEndsWithNewline ? 2 : 0);
+  if (len > E.fileSize) len = E.fileSize;
+
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return 0;
+  char buf[4096 + 2];
+  if (pread(fd, buf, len, E.fileSize - len) != len) len = 0;
+  close(fd);
+
+  if (E.fileEndsWithNewline) {
+    if (len == 0 || buf[--len] != '\n') return 0;
+    if (len > size && buf[len - 1] == '\r') len--;
+  } else if (len > 0 && buf[len - 1] == '\r') {
+    /* The '\r' may start a line ending; let a full reload sort it out. */
+    return 0;
+  }
+  return len >= size &&
+         !memcmp(&buf[len - size], &row->chars[row->size - size], size);
+}
+
+void editorFollowTail() {
+  E.cursorY = (E.numRows > 0) ? E.numRows - 1 : 0;
+  E.cursorX = 0;
+  int top = editorVisibleRow(E.cursorY) - E.screenRows + 1;
+  E.rowOffset = editorFileRow(top > 0 ? top : 0);
+}
+
+int editorReloadFile() {
+  FILE *fp = fopen(E.filename, "r");
+  if (!fp) return 0;
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == -1) {
+    fclose(fp);
+    return 0;
+  }
+
+  int append = (st.st_ino == E.fileIno && st.st_size > E.fileSize &&
+                editorTailMatches());
+  if (append) {
+    fseeko(fp, E.fileSize, SEEK_SET);
+    editorReadRows(fp, !E.fileEndsWithNewline);
+  } else {
+    for (int i = 0; i < E.numRows; i++) editorFreeRow(&E.row[i]);
+    free(E.row);
+    E.row = NULL;
+    E.numRows = 0;
+    E.fileEndsWithNewline = 1;
+    editorLoadRows(fp);
+
+    if (E.cursorY > E.numRows) E.cursorY = E.numRows;
+    int rowLen = (E.cursorY < E.numRows) ? E.row[E.cursorY].size : 0;
+    if (E.cursorX > rowLen) E.cursorX = rowLen;
+  }
+  /* Record what was actually read: lines written while reading are
+   * picked up by the next reload instead of being loaded twice. */
+  E.fileSize = ftello(fp);
+  if (fstat(fileno(fp), &st) == 0) E.fileMtime = st.st_mtim;
+  E.fileIno = st.st_ino;
+  fclose(fp);
+
+  editorMarkSaved();
+  if (E.follow) editorFollowTail();
+  return 1;
+}
+
+int editorFileChanged() {
+  struct stat st;
+  if (stat(E.filename, &st) == -1) {
+    editorSetStatusMessage("File was removed from disk");
+    return 1;
+  }
+  if (st.st_ino == E.fileIno && st.st_size == E.fileSize &&
+      st.st_mtim.tv_sec == E.fileMtime.tv_sec &&
+      st.st_mtim.tv_nsec == E.fileMtime.tv_nsec)
+    return 0;
+
+  if (E.dirty) {
+    E.fileSize = st.st_size;
+    E.fileIno = st.st_ino;
+    E.fileMtime = st.st_mtim;
+    editorSetStatusMessage("File changed on disk! Saving will overwrite it.");
+    return 1;
+  }
+  return editorReloadFile();
+}
+
+void editorHandleFileEvents() {
+  if (E.watchFd == -1 || E.inPrompt) return;
+
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } u;
+  ssize_t len;
+  int changed = 0, replaced = 0;
+
+  char *slash = strrchr(E.filename, '/');
+  char *base = slash ? slash + 1 : E.filename;
+
+  while ((len = read(E.watchFd, u.buf, sizeof(u.buf))) > 0) {
+    char *p = u.buf;
+    while (p < u.buf + len) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      if (event->wd == E.watchWd) {
+        if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+          replaced = 1;
+        changed = 1;
+      } else if (event->wd == E.watchDirWd && event->len &&
+                 !strcmp(event->name, base)) {
+        replaced = 1;
+        changed = 1;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  if (replaced) editorWatchFile();
+  if (changed && editorFileChanged()) editorRefreshScreen();
+}
+
 /*** find ***/
 
 void editorFindCallback(char *query, int key) {
@@ -656,7 +3340,8 @@ void editorFindCallback(char *query, int key) {
     if (match) {
       last_match = current;
       E.cursorY = current;
-      E.cursorX = editorRowRxToCx(row, match - row->render);
+      E.cursorX = editorRowRxToCx(row,
+          editorRowRenderToRx(row, match - row->render));
       E.rowOffset = E.numRows;
 
       saved_highlight_line = current;
@@ -686,6 +3371,402 @@ void editorFind() {
   }
 }
 
+/*** replace ***/
+
+struct editorPattern {
+  char *literal;
+  int literalLen;
+  int isRegex;
+  regex_t regex;
+  regmatch_t *matches;
+  int matchesCap;
+};
+
+int editorCompilePattern(struct editorPattern *pattern, char *query) {
+  int len = strlen(query);
+  pattern->literal = query;
+  pattern->literalLen = len;
+  pattern->isRegex = (len > 2 && query[0] == '/' && query[len - 1] == '/');
+  pattern->matches = NULL;
+  pattern->matchesCap = 0;
+  if (!pattern->isRegex) return 0;
+
+  query[len - 1] = '\0';
+  int err = regcomp(&pattern->regex, &query[1], REG_EXTENDED);
+  query[len - 1] = '/';
+  return err;
+}
+
+void editorFreePattern(struct editorPattern *pattern) {
+  if (pattern->isRegex) regfree(&pattern->regex);
+  free(pattern->matches);
+}
+
+int editorPatternGroups(struct editorPattern *pattern) {
+  return pattern->isRegex ? KILO_MAX_GROUPS : 1;
+}
+
+int editorMatchPattern(struct editorPattern *pattern, editorRow *row, int from,
+                       regmatch_t *groups) {
+  if (from > row->size) return 0;
+
+  if (!pattern->isRegex) {
+    char *match = memmem(&row->chars[from], row->size - from,
+                         pattern->literal, pattern->literalLen);
+    if (match == NULL) return 0;
+    groups[0].rm_so = match - row->chars;
+    groups[0].rm_eo = groups[0].rm_so + pattern->literalLen;
+    return 1;
+  }
+
+  int flags = (from > 0) ? REG_NOTBOL : 0;
+#ifdef REG_STARTEND
+  groups[0].rm_so = from;
+  groups[0].rm_eo = row->size;
+  if (regexec(&pattern->regex, row->chars, KILO_MAX_GROUPS, groups,
+              flags | REG_STARTEND))
+    return 0;
+#else
+  if (regexec(&pattern->regex, &row->chars[from], KILO_MAX_GROUPS, groups,
+              flags))
+    return 0;
+  for (int j = 0; j < KILO_MAX_GROUPS; j++) {
+    if (groups[j].rm_so == -1) continue;
+    groups[j].rm_so += from;
+    groups[j].rm_eo += from;
+  }
+#endif
+  return 1;
+}
+
+int editorExpandReplacement(struct editorPattern *pattern, char *dest,
+                            editorRow *row, char *with, regmatch_t *groups) {
+  if (!pattern->isRegex) {
+    int len = strlen(with);
+    if (dest) memcpy(dest, with, len);
+    return len;
+  }
+
+  int len = 0;
+  for (char *c = with; *c; c++) {
+    if (c[0] == '\\' && c[1] >= '0' && c[1] <= '9') {
+      regmatch_t *group = &groups[c[1] - '0'];
+      c++;
+      if (group->rm_so == -1) continue;
+      if (dest)
+        memcpy(&dest[len], &row->chars[group->rm_so],
+               group->rm_eo - group->rm_so);
+      len += group->rm_eo - group->rm_so;
+      continue;
+    }
+    if (c[0] == '\\' && c[1] == '\\') c++;
+    if (dest) dest[len] = *c;
+    len++;
+  }
+  return len;
+}
+
+/* Replaces up to 'limit' matches (all of them when negative) from byte
+ * 'from' onwards. Matches are collected in one scan, then the row is
+ * rebuilt into an exactly sized buffer and updated once. '*end' is set
+ * to the offset just past the last replacement. */
+int editorReplaceInRow(struct editorPattern *pattern, editorRow *row, int from,
+                       char *with, int limit, int *end) {
+  int stride = editorPatternGroups(pattern);
+  int count = 0, newSize = 0, prevEnd = 0;
+  regmatch_t groups[KILO_MAX_GROUPS];
+
+  while (count != limit && editorMatchPattern(pattern, row, from, groups)) {
+    if ((count + 1) * stride > pattern->matchesCap) {
+      pattern->matchesCap = pattern->matchesCap ? pattern->matchesCap * 2 : 64 * stride;
+      pattern->matches = realloc(pattern->matches,
+                                 sizeof(regmatch_t) * pattern->matchesCap);
+    }
+    memcpy(&pattern->matches[count * stride], groups, sizeof(regmatch_t) * stride);
+    count++;
+
+    newSize += groups[0].rm_so - prevEnd +
+               editorExpandReplacement(pattern, NULL, row, with, groups);
+    prevEnd = groups[0].rm_eo;
+    from = (groups[0].rm_eo > groups[0].rm_so) ? groups[0].rm_eo
+                                                : groups[0].rm_eo + 1;
+  }
+  if (count == 0) return 0;
+  newSize += row->size - prevEnd;
+
+  char *chars = malloc(newSize + 1);
+  int len = 0;
+  prevEnd = 0;
+  for (int j = 0; j < count; j++) {
+    regmatch_t *match = &pattern->matches[j * stride];
+    memcpy(&chars[len], &row->chars[prevEnd], match[0].rm_so - prevEnd);
+    len += match[0].rm_so - prevEnd;
+    len += editorExpandReplacement(pattern, &chars[len], row, with, match);
+    prevEnd = match[0].rm_eo;
+  }
+  if (end) *end = len;
+  memcpy(&chars[len], &row->chars[prevEnd], row->size - prevEnd);
+  chars[newSize] = '\0';
+
+  editorIndexWords(row, 0, row->size, -1);
+  free(row->chars);
+  row->chars = chars;
+  row->size = newSize;
+  editorIndexWords(row, 0, row->size, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+  return count;
+}
+
+void editorReplace() {
+  char *query = editorPrompt("Replace: %s (/regex/ or text, ESC to cancel)", NULL);
+  if (query == NULL) return;
+
+  struct editorPattern pattern;
+  if (editorCompilePattern(&pattern, query)) {
+    editorSetStatusMessage("Invalid regex: %s", query);
+    free(query);
+    return;
+  }
+
+  char *with = editorReadPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+  if (with == NULL) {
+    editorFreePattern(&pattern);
+    free(query);
+    return;
+  }
+
+  int count = 0, replaceAll = 0;
+  regmatch_t groups[KILO_MAX_GROUPS];
+  E.inPrompt++;
+  for (int y = 0; y < E.numRows; y++) {
+    editorRow *row = &E.row[y];
+    if (replaceAll) {
+      count += editorReplaceInRow(&pattern, row, 0, with, -1, NULL);
+      continue;
+    }
+
+    int x = 0;
+    while (editorMatchPattern(&pattern, row, x, groups)) {
+      E.cursorY = y;
+      E.cursorX = groups[0].rm_so;
+      editorSetStatusMessage("Replace this match? (y/n/a/q)");
+      editorRefreshScreen();
+
+      int c = editorReadKey();
+      if (c == 'y') {
+        count += editorReplaceInRow(&pattern, row, groups[0].rm_so, with, 1, &x);
+        if (groups[0].rm_eo == groups[0].rm_so) x++;
+      } else if (c == 'n') {
+        x = (groups[0].rm_eo > groups[0].rm_so) ? groups[0].rm_eo
+                                                 : groups[0].rm_eo + 1;
+      } else if (c == 'a') {
+        count += editorReplaceInRow(&pattern, row, groups[0].rm_so, with, -1, NULL);
+        replaceAll = 1;
+        break;
+      } else {
+        y = E.numRows;
+        break;
+      }
+    }
+  }
+  E.inPrompt--;
+
+  if (E.cursorY < E.numRows && E.cursorX > E.row[E.cursorY].size)
+    E.cursorX = E.row[E.cursorY].size;
+  editorSetStatusMessage("Replaced %d occurrence%s", count, count == 1 ? "" : "s");
+  editorFreePattern(&pattern);
+  free(with);
+  free(query);
+}
+
+/*** diff ***/
+
+/* Marks the rows of a hunk that replaced 'removed' saved rows with the
+ * rows [from, to): paired rows count as changed, and deletions left over
+ * are shown on the row below the hunk. */
+void editorMarkHunk(int from, int to, int removed) {
+  for (int i = from; i < to; i++) {
+    E.diffMarks[i] = removed ? '~' : '+';
+    if (removed) removed--;
+  }
+  if (removed && E.numRows) {
+    int below = (to < E.numRows) ? to : E.numRows - 1;
+    if (!E.diffMarks[below]) E.diffMarks[below] = '-';
+  }
+}
+
+/* Aligns saved rows [0, n) with current rows [0, m), both offset by
+ * 'start', using Myers' algorithm on the row hashes. Returns 0 if they
+ * differ by more than KILO_DIFF_MAX_EDITS rows. */
+int editorDiffRows(int start, int n, int m) {
+  const uint64_t *saved = &E.savedHashes[start];
+  editorRow *rows = &E.row[start];
+  int max = n + m;
+  if (max > KILO_DIFF_MAX_EDITS) max = KILO_DIFF_MAX_EDITS;
+
+  /* Round d keeps the furthest x on diagonals -d..d at trace[d * d]. The
+   * trace grows with the rounds actually run, not with the cap. */
+  int *trace = NULL;
+  int traceCap = 0;
+  int found = -1;
+  for (int d = 0; d <= max && found == -1; d++) {
+    if ((d + 1) * (d + 1) > traceCap) {
+      traceCap = (traceCap ? 2 * traceCap : 64);
+      if (traceCap < (d + 1) * (d + 1)) traceCap = (d + 1) * (d + 1);
+      trace = realloc(trace, sizeof(int) * traceCap);
+    }
+    int *prev = &trace[(d - 1) * (d - 1) + d - 1];
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (d == 0) x = 0;
+      else if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) x = prev[k + 1];
+      else x = prev[k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && saved[x] == rows[y].hash) {
+        x++;
+        y++;
+      }
+      trace[d * d + k + d] = x;
+      if (x >= n && y >= m) {
+        found = d;
+        break;
+      }
+    }
+  }
+  if (found == -1) {
+    free(trace);
+    return 0;
+  }
+
+  int *removed = calloc(m + 1, sizeof(int));
+  int x = n, y = m;
+  for (int d = found; d > 0; d--) {
+    int *prev = &trace[(d - 1) * (d - 1) + d - 1];
+    int k = x - y;
+    if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) {
+      x = prev[k + 1];
+      y = x - k - 1;
+      E.diffMarks[start + y] = '+';
+    } else {
+      x = prev[k - 1];
+      y = x - k + 1;
+      removed[y]++;
+    }
+  }
+
+  int i = 0;
+  while (i <= m) {
+    int from = i, count = 0;
+    while (1) {
+      count += removed[i];
+      if (i < m && E.diffMarks[start + i] == '+') i++;
+      else break;
+    }
+    if (i > from || count) editorMarkHunk(start + from, start + i, count);
+    i++;
+  }
+  free(removed);
+  free(trace);
+  return 1;
+}
+
+/* Widens the rows edited since the last save to include [from, to).
+ * Rows before diffFrom still match the saved rows at the same index and
+ * rows from diffTo on match them shifted by the change in row count. */
+void editorDiffTouch(int from, int to) {
+  if (from < E.diffFrom) E.diffFrom = from;
+  if (to > E.diffTo) E.diffTo = to;
+}
+
+/* Drops every mark until the next edit or save. */
+void editorClearDiff() {
+  if (E.numRows + 1 > E.diffMarksCap) {
+    E.diffMarks = realloc(E.diffMarks, E.numRows + 1);
+    E.diffMarksCap = E.numRows + 1;
+  }
+  memset(E.diffMarks, 0, E.diffMarksCap);
+  E.diffMarkFrom = E.diffMarkTo = 0;
+  E.diffEdits = E.dirty;
+}
+
+/* Checks rows [from, to) against the saved file before a buffer that
+ * matches by hash counts as clean, so that a hash collision can never
+ * hide unsaved edits. This reads the file, but only when the buffer
+ * turns clean again. */
+int editorRowsMatchFile(int from, int to) {
+  if (from >= to) return 1;
+  if (E.filename == NULL) return 0;
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  char *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+
+  const char *p = data, *end = data + st.st_size;
+  for (int i = 0; i < from && p; i++) {
+    p = memchr(p, '\n', end - p);
+    if (p) p++;
+  }
+  int matches = (p != NULL);
+  for (int i = from; i < to && matches; i++) {
+    const char *newline = (p < end) ? memchr(p, '\n', end - p) : NULL;
+    int len = (newline ? newline : end) - p;
+    while (len > 0 && p[len - 1] == '\r') len--;
+    matches = (p < end && len == E.row[i].size &&
+               !memcmp(p, E.row[i].chars, len));
+    p = newline ? newline + 1 : end;
+  }
+  munmap(data, st.st_size);
+  return matches;
+}
+
+/* Recomputes the gutter marks after the buffer changed. Rows are only
+ * compared by hash: the common head and tail are skipped and the rest is
+ * aligned with editorDiffRows, or compared row by row if that gives up.
+ * A buffer whose rows all match the saved state is clean again once the
+ * edited rows also match the file byte for byte. */
+void editorUpdateDiff() {
+  if (E.dirty == E.diffEdits) return;
+
+  if (E.numRows + 1 > E.diffMarksCap) {
+    E.diffMarks = realloc(E.diffMarks, E.numRows + 1);
+    memset(&E.diffMarks[E.diffMarksCap], 0, E.numRows + 1 - E.diffMarksCap);
+    E.diffMarksCap = E.numRows + 1;
+  }
+  /* Only the rows marked last time need clearing. */
+  if (E.diffMarkFrom < E.diffMarkTo)
+    memset(&E.diffMarks[E.diffMarkFrom], 0, E.diffMarkTo - E.diffMarkFrom);
+
+  int n = E.numSavedRows, m = E.numRows;
+  int common = (n < m) ? n : m;
+  int head = (E.diffFrom < common) ? E.diffFrom : common;
+  int tail = (E.diffTo < m) ? m - E.diffTo : 0;
+  if (tail > common - head) tail = common - head;
+  while (head < n - tail && head < m - tail &&
+         E.savedHashes[head] == E.row[head].hash)
+    head++;
+  while (tail < n - head && tail < m - head &&
+         E.savedHashes[n - 1 - tail] == E.row[m - 1 - tail].hash)
+    tail++;
+
+  if (head + tail == n && head + tail == m) {
+    if (editorRowsMatchFile(E.diffFrom, E.diffTo < m ? E.diffTo : m))
+      E.dirty = 0;
+  } else if (!editorDiffRows(head, n - head - tail, m - head - tail)) {
+    for (int i = head; i < m - tail; i++)
+      if (i >= n - tail || E.savedHashes[i] != E.row[i].hash)
+        E.diffMarks[i] = (i < n - tail) ? '~' : '+';
+    if (n > m) editorMarkHunk(m - tail, m - tail, n - m);
+  }
+  E.diffMarkFrom = head;
+  E.diffMarkTo = m - tail + 1;
+  E.diffEdits = E.dirty;
+}
+
 /*** append buffer ***/
 
 struct appendBuffer {
@@ -715,20 +3796,216 @@ void editorScroll() {
   if (E.cursorY < E.numRows)
     E.renderX = editorRowCxToRx(&E.row[E.cursorY], E.cursorX);
 
+  int fold = editorFoldAt(E.cursorY);
+  if (fold != -1 && E.cursorY != E.folds[fold].start) editorRemoveFold(fold);
+  fold = editorFoldAt(E.rowOffset);
+  if (fold != -1) E.rowOffset = E.folds[fold].start;
+
+  int cursorRow = editorVisibleRow(E.cursorY);
   if (E.cursorY < E.rowOffset)
     E.rowOffset = E.cursorY;
-  if (E.cursorY >= E.rowOffset + E.screenRows)
-    E.rowOffset = E.cursorY - E.screenRows + 1;
+  if (cursorRow >= editorVisibleRow(E.rowOffset) + E.screenRows)
+    E.rowOffset = editorFileRow(cursorRow - E.screenRows + 1);
+  int textCols = E.screenCols - E.gutterWidth;
+  if (textCols < 1) textCols = 1;
   if (E.renderX < E.colOffset)
     E.colOffset = E.renderX;
-  if (E.renderX >= E.colOffset + E.screenCols)
-    E.colOffset = E.renderX - E.screenCols + 1;
+  if (E.renderX >= E.colOffset + textCols)
+    E.colOffset = E.renderX - textCols + 1;
+}
+
+int editorDrawRow(struct appendBuffer *ab, editorRow *row, int startCol,
+                  int width) {
+  int at = 0, renderX = 0;
+  if (row->isAscii)
+    at = renderX = (startCol < row->renderSize) ? startCol : row->renderSize;
+  else {
+    if (row->numChunks) {
+      editorChunk *chunk = &row->chunks[editorRowFindChunk(row,
+          offsetof(editorChunk, renderX), startCol)];
+      at = chunk->renderAt;
+      renderX = chunk->renderX;
+    }
+    while (at < row->renderSize) {
+      int cp;
+      int len = utf8Decode(&row->render[at], row->renderSize - at, &cp);
+      int charWidth = utf8CharWidth(cp);
+      if (renderX + charWidth > startCol) break;
+      at += len;
+      renderX += charWidth;
+    }
+    if (renderX < startCol && at < row->renderSize) {
+      int cp;
+      at += utf8Decode(&row->render[at], row->renderSize - at, &cp);
+      renderX += utf8CharWidth(cp);
+      for (int i = startCol; i < renderX; i++) abAppend(ab, " ", 1);
+    }
+  }
+
+  int endCol = startCol + width;
+  int currentColor = -1;
+  while (at < row->renderSize) {
+    char *c = &row->render[at];
+    int cp = (unsigned char) *c;
+    int len = 1, charWidth = 1;
+    if (!row->isAscii) {
+      len = utf8Decode(c, row->renderSize - at, &cp);
+      charWidth = utf8CharWidth(cp);
+    }
+    if (renderX + charWidth > endCol) break;
+
+    if (cp < 0 || (cp < 0x80 && iscntrl(cp)) || (cp >= 0x80 && cp < 0xa0)) {
+      char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      if (currentColor != -1) {
+        char buf[16];
+        int colorLen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
+        abAppend(ab, buf, colorLen);
+      }
+    } else if (row->highlight[at] == HL_NORMAL) {
+      if (currentColor != -1) {
+        abAppend(ab, "\x1b[39m", 5);
+        currentColor = -1;
+      }
+      abAppend(ab, c, len);
+    } else {
+      int color = editorSyntaxToColor(row->highlight[at]);
+      if (color != currentColor) {
+        currentColor = color;
+        char buf[16];
+        int colorLen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, colorLen);
+      }
+      abAppend(ab, c, len);
+    }
+    at += len;
+    renderX += charWidth;
+  }
+  abAppend(ab, "\x1b[39m", 5);
+  return (renderX > startCol) ? renderX - startCol : 0;
+}
+
+uint64_t editorHashBytes(const char *s, int len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int j = 0; j < len; j++) {
+    hash ^= (unsigned char) s[j];
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+void editorFlushLine(struct appendBuffer *ab, int y, struct appendBuffer *line) {
+  uint64_t hash = editorHashBytes(line->b, line->len);
+  if (!E.shadowValid || E.shadow[y] != hash) {
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    abAppend(ab, buf, len);
+    abAppend(ab, line->b, line->len);
+    E.shadow[y] = hash;
+  }
+  line->len = 0;
+}
+
+void editorScrollRegion(struct appendBuffer *ab) {
+  int delta = editorVisibleRow(E.rowOffset) -
+              editorVisibleRow(E.shadowRowOffset);
+  if (!E.shadowValid || E.colOffset != E.shadowColOffset || delta == 0 ||
+      abs(delta) >= E.screenRows)
+    return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                     E.screenRows, abs(delta), delta > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+
+  int kept = E.screenRows - abs(delta);
+  if (delta > 0) {
+    memmove(&E.shadow[0], &E.shadow[delta], sizeof(uint64_t) * kept);
+    memset(&E.shadow[kept], 0, sizeof(uint64_t) * delta);
+  } else {
+    memmove(&E.shadow[-delta], &E.shadow[0], sizeof(uint64_t) * kept);
+    memset(&E.shadow[0], 0, sizeof(uint64_t) * -delta);
+  }
+}
+
+/* Draws a screen line with one entry of the completion popup over it:
+ * the row is drawn in two spans around the box. */
+void editorDrawPopupLine(struct appendBuffer *ab, int fileRow, int entry,
+                         int popupCol, int popupWidth) {
+  int drawn = 0;
+  if (fileRow < E.numRows)
+    drawn = editorDrawRow(ab, &E.row[fileRow], E.colOffset, popupCol);
+  for (; drawn < popupCol; drawn++) abAppend(ab, " ", 1);
+
+  char *word = E.completions[entry];
+  int len = strlen(word);
+  if (len > popupWidth - 2) len = popupWidth - 2;
+  if (entry == E.completionIndex) abAppend(ab, "\x1b[7m ", 5);
+  else abAppend(ab, "\x1b[100m ", 7);
+  abAppend(ab, word, len);
+  for (int j = len; j < popupWidth - 1; j++) abAppend(ab, " ", 1);
+  abAppend(ab, "\x1b[m", 3);
+
+  if (fileRow < E.numRows)
+    editorDrawRow(ab, &E.row[fileRow], E.colOffset + popupCol + popupWidth,
+                  E.screenCols - E.gutterWidth - popupCol - popupWidth);
+}
+
+void editorDrawGutter(struct appendBuffer *ab, int fileRow) {
+  if (E.gutterWidth == 0) return;
+  int mark = (fileRow < E.numRows) ? E.diffMarks[fileRow] : 0;
+  switch (mark) {
+    case '+': abAppend(ab, "\x1b[32m+\x1b[39m", 11); break;
+    case '~': abAppend(ab, "\x1b[33m~\x1b[39m", 11); break;
+    case '-': abAppend(ab, "\x1b[31m-\x1b[39m", 11); break;
+    default: abAppend(ab, " ", 1);
+  }
+  for (int j = 1; j < E.gutterWidth; j++) abAppend(ab, " ", 1);
+}
+
+void editorDrawFoldMarker(struct appendBuffer *ab, int fileRow, int drawn,
+                          int width) {
+  int j = editorFoldAt(fileRow);
+  if (j == -1 || drawn >= width) return;
+  char marker[32];
+  int len = snprintf(marker, sizeof(marker), " ... %d lines",
+                     E.folds[j].end - E.folds[j].start);
+  if (len > width - drawn) len = width - drawn;
+  abAppend(ab, "\x1b[36m", 5);
+  abAppend(ab, marker, len);
+  abAppend(ab, "\x1b[39m", 5);
 }
 
 void editorDrawRows(struct appendBuffer *ab) {
+  int textCols = E.screenCols - E.gutterWidth;
+  int popupTop = -1, popupCol = 0, popupWidth = 0;
+  if (E.numCompletions) {
+    for (int j = 0; j < E.numCompletions; j++) {
+      int len = strlen(E.completions[j]) + 2;
+      if (len > popupWidth) popupWidth = len;
+    }
+    if (popupWidth > textCols) popupWidth = textCols;
+    int cursorRow = editorVisibleRow(E.cursorY) - editorVisibleRow(E.rowOffset);
+    popupTop = cursorRow + 1;
+    if (popupTop + E.numCompletions > E.screenRows)
+      popupTop = cursorRow - E.numCompletions;
+    if (popupTop < 0) popupTop = 0;
+    popupCol = E.renderX - E.colOffset - E.completionPrefixLen;
+    if (popupCol + popupWidth > textCols)
+      popupCol = textCols - popupWidth;
+    if (popupCol < 0) popupCol = 0;
+  }
+
+  struct appendBuffer line = ABUF_INIT;
+  int fileRow = E.rowOffset;
   for (int y = 0; y < E.screenRows; y++) {
-    int fileRow = y + E.rowOffset;
-    if (fileRow >= E.numRows) {
+    if (y > 0)
+      fileRow = (fileRow < E.numRows) ? editorNextVisibleRow(fileRow) : fileRow + 1;
+    int inPopup = (popupTop != -1 && y >= popupTop &&
+                   y < popupTop + E.numCompletions);
+    if (fileRow >= E.numRows && !inPopup) {
       if (E.numRows == 0 && y == E.screenRows / 3) {
         char welcome[80];
         int welcomeLen = snprintf(welcome, sizeof(welcome),
@@ -736,55 +4013,33 @@ void editorDrawRows(struct appendBuffer *ab) {
         if (welcomeLen > E.screenCols) welcomeLen = E.screenCols;
         int padding = (E.screenCols - welcomeLen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          abAppend(&line, "~", 1);
       padding --;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomeLen);
+        while (padding--) abAppend(&line, " ", 1);
+        abAppend(&line, welcome, welcomeLen);
       } else {
-        abAppend(ab, "~", 1);
+        abAppend(&line, "~", 1);
       }
     } else {
-      int len = E.row[fileRow].renderSize - E.colOffset;
-      if (len < 0) len = 0;
-      if (len > E.screenCols) len = E.screenCols;
-      char *c = &E.row[fileRow].render[E.colOffset];
-      unsigned char *highlight = &E.row[fileRow].highlight[E.colOffset];
-      int currentColor = -1;
-      for (int i = 0; i < len; i++) {
-        if (iscntrl(c[i])) {
-          char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (currentColor != -1) {
-            char buf[16];
-            int colorLen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-            abAppend(ab, buf, colorLen);
-          }
-        } else if (highlight[i] == HL_NORMAL) {
-          if (currentColor != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            currentColor = -1;
-          }
-	  abAppend(ab, &c[i], 1);
-        } else {
-          int color = editorSyntaxToColor(highlight[i]);
-          if (color != currentColor) {
-            currentColor = color;
-            char buf[16];
-            int colorLen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, colorLen);
-          }
-          abAppend(ab, &c[i], 1);
-        }
+      editorDrawGutter(&line, fileRow);
+      if (inPopup) {
+        editorDrawPopupLine(&line, fileRow, y - popupTop, popupCol, popupWidth);
+      } else if (editorRowSelected(fileRow)) {
+        abAppend(&line, "\x1b[7m", 4);
+        int drawn = editorDrawRow(&line, &E.row[fileRow], E.colOffset, textCols);
+        editorDrawFoldMarker(&line, fileRow, drawn, textCols);
+        abAppend(&line, "\x1b[m", 3);
+      } else {
+        int drawn = editorDrawRow(&line, &E.row[fileRow], E.colOffset, textCols);
+        editorDrawFoldMarker(&line, fileRow, drawn, textCols);
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    abAppend(&line, "\x1b[K", 3);
+    editorFlushLine(ab, y, &line);
   }
+  abFree(&line);
 }
 
 void editorDrawStatusBar(struct appendBuffer *ab) {
@@ -793,7 +4048,12 @@ void editorDrawStatusBar(struct appendBuffer *ab) {
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
       E.filename ? E.filename : "[No Name]", E.numRows,
       E.dirty ? "(modified)" : "");
-  int renderLen = snprintf(renderStatus, sizeof(renderStatus), "%s | %d/%d",
+  char selectStatus[32] = "";
+  int start, end;
+  if (E.selectActive && editorSelection(&start, &end))
+    snprintf(selectStatus, sizeof(selectStatus), "%d selected | ", end - start);
+  int renderLen = snprintf(renderStatus, sizeof(renderStatus), "%s%s%s | %d/%d",
+      selectStatus, E.follow ? "follow | " : "",
       E.syntax ? E.syntax->filetype : "no filetype", E.cursorY + 1, E.numRows);
   if (len > E.screenCols) len = E.screenCols;
   abAppend(ab, status, len);
@@ -807,7 +4067,6 @@ void editorDrawStatusBar(struct appendBuffer *ab) {
     }
   }
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 void editorDrawMessageBar(struct appendBuffer *ab) {
@@ -819,25 +4078,45 @@ void editorDrawMessageBar(struct appendBuffer *ab) {
 }
 
 void editorRefreshScreen() {
+  editorFlushOutput();
+  if (editorOutputBusy()) {
+    E.refreshPending = 1;
+    return;
+  }
+  E.refreshPending = 0;
+
+  editorUpdateDiff();
   editorScroll();
 
   struct appendBuffer ab = ABUF_INIT;
 
+  abAppend(&ab, "\x1b[?2026h", 8);
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
+  editorScrollRegion(&ab);
   editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+
+  struct appendBuffer line = ABUF_INIT;
+  editorDrawStatusBar(&line);
+  editorFlushLine(&ab, E.screenRows, &line);
+  editorDrawMessageBar(&line);
+  editorFlushLine(&ab, E.screenRows + 1, &line);
+  abFree(&line);
+
+  E.shadowValid = 1;
+  E.shadowRowOffset = E.rowOffset;
+  E.shadowColOffset = E.colOffset;
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursorY - E.rowOffset) + 1,
-                                            (E.renderX - E.colOffset) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+           editorVisibleRow(E.cursorY) - editorVisibleRow(E.rowOffset) + 1,
+           (E.renderX - E.colOffset) + E.gutterWidth + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(&ab, "\x1b[?2026l", 8);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorQueueOutput(ab.b, ab.len);
   abFree(&ab);
 }
 
@@ -852,12 +4131,18 @@ void editorSetStatusMessage(const char *fmt, ...) {
 /*** input ***/
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  return editorReadPrompt(prompt, callback, 0);
+}
+
+char *editorReadPrompt(char *prompt, void (*callback)(char *, int),
+                       int allowEmpty) {
   size_t bufSize = 128;
   char *buf = malloc(bufSize);
 
   size_t bufLen = 0;
   buf[0] = '\0';
 
+  E.inPrompt++;
   while (1) {
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
@@ -869,14 +4154,16 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       editorSetStatusMessage("");
       if (callback) callback(buf, c);
       free(buf);
+      E.inPrompt--;
       return NULL;
     } else if (c == '\r') {
-      if (bufLen != 0) {
+      if (bufLen != 0 || allowEmpty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
+        E.inPrompt--;
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (!iscntrl(c) && c < 256) {
       if (bufLen == bufSize - 1) {
         bufSize *= 2;
         buf = realloc(buf, bufSize);
@@ -891,27 +4178,33 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
   editorRow *row = (E.cursorY >= E.numRows) ? NULL : &E.row[E.cursorY];
+  int renderX = row ? editorRowCxToRx(row, E.cursorX) : 0;
 
   switch (key) {
     case ARROW_LEFT:
-      if (E.cursorX != 0) E.cursorX--;
+      if (E.cursorX != 0) E.cursorX = editorRowPrevChar(row, E.cursorX);
       else if (E.cursorY > 0) {
-        E.cursorY--;
+        E.cursorY = editorPrevVisibleRow(E.cursorY);
         E.cursorX = E.row[E.cursorY].size;
       }
       break;
     case ARROW_RIGHT:
-      if (row && E.cursorX < row->size) E.cursorX++;
+      if (row && E.cursorX < row->size)
+        E.cursorX = editorRowNextChar(row, E.cursorX);
       else if (row && E.cursorX == row->size) {
-        E.cursorY++;
+        E.cursorY = editorNextVisibleRow(E.cursorY);
         E.cursorX = 0;
       }
       break;
     case ARROW_UP:
-      if (E.cursorY != 0) E.cursorY--;
+      if (E.cursorY != 0) E.cursorY = editorPrevVisibleRow(E.cursorY);
+      if (E.cursorY < E.numRows)
+        E.cursorX = editorRowRxToCx(&E.row[E.cursorY], renderX);
       break;
     case ARROW_DOWN:
-      if (E.cursorY < E.numRows) E.cursorY++;
+      if (E.cursorY < E.numRows) E.cursorY = editorNextVisibleRow(E.cursorY);
+      if (E.cursorY < E.numRows)
+        E.cursorX = editorRowRxToCx(&E.row[E.cursorY], renderX);
       break;
   }
 
@@ -925,11 +4218,41 @@ void editorProcessKeypress() {
 
   int c = editorReadKey();
 
+  if (E.numCompletions && editorCompletionKey(c)) return;
+
   switch (c) {
     case '\r':
+      E.selectActive = 0;
       editorInsertNewLine();
       break;
 
+    case '\t':
+      if (E.selectActive) editorIndentSelection(0);
+      else editorInsertChar(c);
+      break;
+
+    case SHIFT_TAB:
+      editorIndentSelection(1);
+      break;
+
+    case CTRL_KEY('b'):
+      E.selectActive = !E.selectActive;
+      E.selectAnchor = E.cursorY;
+      editorSetStatusMessage(E.selectActive ? "Mark set" : "Mark cleared");
+      break;
+
+    case CTRL_KEY('c'):
+      editorCopySelection(0);
+      break;
+
+    case CTRL_KEY('x'):
+      editorCopySelection(1);
+      break;
+
+    case CTRL_KEY('v'):
+      editorPaste();
+      break;
+
     case CTRL_KEY('q'):
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
@@ -937,6 +4260,7 @@ void editorProcessKeypress() {
         quit_times--;
         return;
       }
+      editorDrainOutput();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -959,9 +4283,35 @@ void editorProcessKeypress() {
       editorFind();
       break;
 
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
+    case CTRL_KEY(']'):
+      editorMatchBracket();
+      break;
+
+    case CTRL_KEY('n'):
+      editorComplete();
+      break;
+
+    case CTRL_KEY('k'):
+      editorToggleFold();
+      break;
+
+    case CTRL_KEY('t'):
+      E.follow = !E.follow;
+      if (E.follow) editorFollowTail();
+      editorSetStatusMessage("Follow mode %s", E.follow ? "on" : "off");
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
+      if (E.selectActive) {
+        editorDelSelection();
+        break;
+      }
       if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
       editorDelChar();
       break;
@@ -969,16 +4319,20 @@ void editorProcessKeypress() {
     case PAGE_UP:
     case PAGE_DOWN:
       {
+        int renderX = (E.cursorY < E.numRows) ?
+            editorRowCxToRx(&E.row[E.cursorY], E.cursorX) : 0;
+        int target = editorVisibleRow(E.rowOffset);
         if (c == PAGE_UP)
-          E.cursorY = E.rowOffset;
-        else if (c == PAGE_DOWN) {
-          E.cursorY = E.rowOffset + E.screenRows - 1;
-          if (E.cursorY > E.numRows) E.cursorY = E.numRows;
-        }
-
-        int times = E.screenRows;
-        while (times--)
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+          target -= E.screenRows;
+        else
+          target += 2 * E.screenRows - 1;
+        int last = editorVisibleRow(E.numRows);
+        if (target > last) target = last;
+        if (target < 0) target = 0;
+
+        E.cursorY = editorFileRow(target);
+        E.cursorX = (E.cursorY < E.numRows) ?
+            editorRowRxToCx(&E.row[E.cursorY], renderX) : 0;
       }
       break;
 
@@ -990,10 +4344,14 @@ void editorProcessKeypress() {
       break;
 
     case CTRL_KEY('l'):
+      break;
+
     case '\x1b':
+      E.selectActive = 0;
       break;
 
     default:
+      E.selectActive = 0;
       editorInsertChar(c);
       break;
   }
@@ -1014,9 +4372,52 @@ void initEditor() {
   E.statusMsg[0] = '\0';
   E.statusMsgTime = 0;
   E.syntax = NULL;
+  E.inPrompt = 0;
+  E.watchFd = E.watchWd = E.watchDirWd = -1;
+  E.fileSize = 0;
+  E.fileIno = 0;
+  E.fileEndsWithNewline = 1;
+  E.follow = 0;
+
+  editorInitSyntax();
 
   if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
   E.screenRows -= 2;
+
+  E.shadow = calloc(E.screenRows + 2, sizeof(uint64_t));
+  E.shadowValid = 0;
+  E.shadowRowOffset = E.shadowColOffset = 0;
+
+  char *tty = ttyname(STDOUT_FILENO);
+  E.outFd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC) : -1;
+  if (E.outFd == -1) E.outFd = STDOUT_FILENO;
+  E.outBuf = NULL;
+  E.outLen = E.outSent = 0;
+  E.refreshPending = 0;
+  editorWatchResize();
+  E.selectActive = 0;
+  E.selectAnchor = 0;
+  E.clipboard = NULL;
+  E.clipboardLens = NULL;
+  E.clipboardRows = 0;
+  E.bracketNodes = NULL;
+  E.numBracketNodes = E.bracketNodesCap = 0;
+  E.bracketFree = E.bracketRoot = 0;
+  E.bracketTreeValid = 0;
+  E.words = NULL;
+  editorResetWords();
+  E.numCompletions = 0;
+  E.savedHashes = NULL;
+  E.numSavedRows = 0;
+  E.diffMarks = NULL;
+  E.diffEdits = -1;
+  E.diffFrom = E.diffTo = 0;
+  E.diffMarkFrom = E.diffMarkTo = E.diffMarksCap = 0;
+  E.gutterWidth = KILO_GUTTER_WIDTH;
+  E.folds = NULL;
+  E.numFolds = E.foldsCap = 0;
+  E.foldHidden = NULL;
+  editorClearFolds();
 }
 
 int main(int argc, char *argv[]) {
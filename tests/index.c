@@ -0,0 +1,113 @@
+/* Index cache tests: an index whose key matches the file but whose
+ * offsets do not must be rejected, never used to build wrong rows.
+ *
+ * Build and run with `make test`. */
+
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+char dir[] = "/tmp/kilo-index-XXXXXX";
+char path[PATH_MAX], indexPath[PATH_MAX];
+int failures = 0;
+
+void openFile() {
+  for (int i = 0; i < E.numRows; i++) editorFreeRow(&E.row[i]);
+  free(E.row);
+  E.row = NULL;
+  E.numRows = 0;
+  editorOpen(path);
+}
+
+/* Rewrites the start of the file in place, keeping its size. */
+void rewriteHead(const char *s) {
+  FILE *fp = fopen(path, "r+");
+  if (!fp) die("fopen");
+  fputs(s, fp);
+  fclose(fp);
+}
+
+/* Makes the index key match the file as it is now, as if the stat
+ * fields had been restored, and optionally moves the first offset. */
+void forgeIndex(uint64_t firstOffset) {
+  struct stat st;
+  if (stat(path, &st) == -1) die("stat");
+  FILE *fp = fopen(indexPath, "r+");
+  if (!fp) die("fopen");
+  struct editorIndexHeader header, key;
+  if (fread(&header, sizeof(header), 1, fp) != 1) die("fread");
+  editorIndexHeaderInit(&key, &st);
+  key.numRows = header.numRows;
+  rewind(fp);
+  fwrite(&key, sizeof(key), 1, fp);
+  fwrite(&firstOffset, sizeof(firstOffset), 1, fp);
+  fclose(fp);
+}
+
+int rowsMatch(const char **rows, int numRows) {
+  if (E.numRows <= numRows) return 0;
+  for (int i = 0; i < numRows; i++)
+    if (E.row[i].size != (int) strlen(rows[i]) ||
+        memcmp(E.row[i].chars, rows[i], E.row[i].size))
+      return 0;
+  return 1;
+}
+
+void report(const char *name, int ok) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", name);
+  if (!ok) failures++;
+}
+
+int main() {
+  if (!mkdtemp(dir)) die("mkdtemp");
+  setenv("XDG_CACHE_HOME", dir, 1);
+  snprintf(path, sizeof(path), "%s/big.txt", dir);
+
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  for (int i = 0; i < 200000; i++) fprintf(fp, "line %06d\n", i);
+  fclose(fp);
+
+  E.watchFd = E.watchWd = E.watchDirWd = -1;
+  E.diffEdits = -1;
+  E.filename = strdup(path);
+  if (!editorIndexPath(indexPath, sizeof(indexPath))) die("editorIndexPath");
+  editorInitSyntax();
+  editorResetWords();
+  editorClearFolds();
+
+  openFile();
+  const char *plain[] = { "line 000000", "line 000001" };
+  report("load through a fresh index", rowsMatch(plain, 2));
+
+  rewriteHead("ab\ncdefghij\n");
+  forgeIndex(0);
+  openFile();
+  const char *split[] = { "ab", "cdefghij", "line 000001" };
+  report("reject a row with a newline inside", rowsMatch(split, 3));
+
+  forgeIndex(1);
+  openFile();
+  report("reject an index that skips the start", rowsMatch(split, 3));
+
+  /* Rewrite in place and put the mtime back, like touch -r or cp -p:
+   * only the ctime tells the index is stale. */
+  struct stat st, before, after;
+  if (stat(path, &st) == -1 || stat(indexPath, &before) == -1) die("stat");
+  rewriteHead("xy\nzzzzzzzz\n");
+  struct timespec times[2] = { st.st_atim, st.st_mtim };
+  if (utimensat(AT_FDCWD, path, times, 0) == -1) die("utimensat");
+  openFile();
+  const char *rewritten[] = { "xy", "zzzzzzzz", "line 000001" };
+  if (stat(indexPath, &after) == -1) die("stat");
+  report("rebuild the index after an in-place rewrite",
+         rowsMatch(rewritten, 3) && after.st_ino != before.st_ino);
+
+  unlink(indexPath);
+  unlink(path);
+  char cacheDir[PATH_MAX];
+  snprintf(cacheDir, sizeof(cacheDir), "%s/kilo", dir);
+  rmdir(cacheDir);
+  rmdir(dir);
+  return failures != 0;
+}
@@ -0,0 +1,74 @@
+/* Reload tests: growth of the file on disk should extend the rows that are
+ * already loaded instead of reading the whole file again.
+ *
+ * Build and run with `make test`. */
+
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+char path[] = "/tmp/kilo-reload-XXXXXX";
+int failures = 0;
+
+void writeFile(const char *mode, const char *s) {
+  FILE *fp = fopen(path, mode);
+  if (!fp) die("fopen");
+  fputs(s, fp);
+  fclose(fp);
+}
+
+/* Opens 'initial', marks the first row in memory only, appends 'more' on
+ * disk and reloads. The mark survives only if the rows were extended. */
+void check(const char *name, const char *initial, const char *more,
+           int extended, const char **rows, int numRows) {
+  for (int i = 0; i < E.numRows; i++) editorFreeRow(&E.row[i]);
+  free(E.row);
+  E.row = NULL;
+  E.numRows = 0;
+
+  writeFile("w", initial);
+  editorOpen(path);
+  E.row[0].chars[0] = '#';
+  writeFile("a", more);
+  editorReloadFile();
+
+  int ok = (E.numRows == numRows) && ((E.row[0].chars[0] == '#') == extended);
+  for (int i = 1; ok && i < numRows; i++)
+    ok = (E.row[i].size == (int) strlen(rows[i]) &&
+          !memcmp(E.row[i].chars, rows[i], E.row[i].size));
+  printf("%s: %s\n", ok ? "ok" : "FAIL", name);
+  if (!ok) failures++;
+}
+
+int main() {
+  int fd = mkstemp(path);
+  if (fd == -1) die("mkstemp");
+  close(fd);
+
+  E.watchFd = E.watchWd = E.watchDirWd = -1;
+  E.diffEdits = -1;
+  editorInitSyntax();
+  editorResetWords();
+  editorClearFolds();
+
+  const char *lines[] = { "", "two", "three" };
+  check("append after a newline", "one\ntwo\n", "three\n", 1, lines, 3);
+
+  const char *partial[] = { "", "twothree", "four" };
+  check("extend a partial last line", "one\ntwo", "three\nfour", 1,
+        partial, 3);
+
+  const char *crlf[] = { "", "two", "three" };
+  check("append to a CRLF file", "one\r\ntwo\r\n", "three\r\n", 1, crlf, 3);
+
+  const char *crlfPartial[] = { "", "twothree" };
+  check("extend a partial CRLF line", "one\r\ntwo", "three\r\n", 1,
+        crlfPartial, 2);
+
+  const char *cr[] = { "", "two", "three" };
+  check("reload after a partial line ending", "one\ntwo\r", "\nthree\n", 0,
+        cr, 3);
+
+  unlink(path);
+  return failures != 0;
+}